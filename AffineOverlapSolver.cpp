@@ -4,118 +4,18 @@
 #include <opencv2/imgproc.hpp>
 #include "stitch.h"
 #include <assert.h>
-#include <omp.h>
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <vector>
 
 using namespace cv;
 
-#define BAD_SCORE (1e29)
-#define NAN_SCORE NAN
-static void cropImage(Size cropSize, Mat& in, Mat& out) {
-	Size sourceSz = Size(in.cols, in.rows);
-	Rect cropRect((Point2i(sourceSz) - Point2i(cropSize)) / 2, cropSize);
-	out = in(cropRect);
-}
-
-float AffineOverlapSolver::findOverlapPair(ScanImage& imageA, ScanImage& imageB, cv::Point2i guess, cv::Point2i range, cv::Point2i& dr)
+cv::Point2i AffineOverlapSolver::stageGuess(ScanSet& set, cv::Point2i gA, cv::Point2i gB)
 {
-	Mat im_a, im_b, im_ca, im_cb;
-
-	/* Load images */
-	if (!imageA.getImage(im_a)) {
-		fatal("Could not load image for overlap: \"" + imageA.path + "\"");
-		return NAN_SCORE;
-	}
-	if (!imageB.getImage(im_b)) {
-		fatal("Could not load image for overlap: \"" + imageA.path + "\"");
-		return NAN_SCORE;
-	}
-
-	/* Crop images */
-	cropImage(cropSize, im_a, im_ca);
-	cropImage(cropSize, im_b, im_cb);
-
-	/* Compute score */
-	return iterBestOverlapNC(im_ca, im_cb, guess, range, logSteps, dr);
-}
-
-float AffineOverlapSolver::findOverlapPair(ScanSet& set, int x, int y, int dir, cv::Point2i guess, cv::Point2i& dr)
-{
-	ScanImage& imA = set.imageAt(x, y);
-	ScanImage& imB = set.imageAt(x, y, dir);
-
-	return findOverlapPair(imA, imB, guess, getRange(dir), dr);
-
-}
-
-float AffineOverlapSolver::findOverlapPair(ScanSet& set, int x, int y, int dir, cv::Point2i& dr)
-{
-	float score;
-	Point2i guess;
-	Point2f stagePos;
-	ScanImage& imA = set.imageAt(x, y);
-	ScanImage& imB = set.imageAt(x, y, dir);
-
-	if (guessMode == GUESS_STAGE) {
-		stagePos = imB.stagePosition - imA.stagePosition;
-		Vec2f gv = set.affineStageToImage * Vec3f(stagePos.x, stagePos.y, 1.);
-		guess = Point2i(gv[0],gv[1]);
-	}
-	else if (guessMode == GUESS_RESULT) {
-		guess = imB.stitchPosition - imA.stitchPosition;
-	}
-	else if (guessMode == GUESS_FIXED) {
-		guess = (dir == DISP_DOWN || dir == DISP_UP) ? guessV : guessH;
-		if (dir == DISP_UP || dir == DISP_LEFT)
-			guess = -guess;
-	}
-	else
-		assert(!"invalid guess mode");
-
-	score = findOverlapPair(imA, imB, guess, getRange(dir), dr);
-
-	/* Warn if overly large */
-	if (norm(dr - guess) > maxDistance) {
-		logf(SLOG_WARN,
-			"overly large difference %f from guess encountered at (%3i,%3i)",
-			x, y, norm(dr - guess));
-	}
-
-	return score;
-}
-
-
-void AffineOverlapSolver::computeOverlapsY(ScanSet& set)
-{
-	log(SLOG_INFO, "Computing vertical overlaps...");
-	progress(STEP_OVERLAPSY, 0, set.gridHeight - 1, "Computing overlaps");
-	for (int y = 0; y < set.gridHeight - 1; y++) {
-
-#pragma omp parallel for 
-		for (int x = 0; x < set.gridWidth; x++) {
-			Point2i dr(0, 0);
-			findOverlapPair(set, x, y, DISP_DOWN, dr);
-			set.imageAt(x, y).displacements[DISP_DOWN] = dr;
-			set.imageAt(x, y, DISP_DOWN).displacements[DISP_UP] = -dr;
-		}
-		progress(STEP_OVERLAPSY, y, set.gridHeight - 1, "Computing overlaps");
-	}
-}
-
-void AffineOverlapSolver::computeOverlapsX(ScanSet& set)
-{
-	log(SLOG_INFO, "Computing horizontal overlaps...");
-	progress(STEP_OVERLAPSX, 0, set.gridWidth - 1, "Computing overlaps");
-	for (int x = 0; x < set.gridWidth - 1; x++) {
-#pragma omp parallel for 
-		for (int y = 0; y < set.gridHeight; y++) {
-			Point2i dr(0, 0);
-			findOverlapPair(set, x, y, DISP_RIGHT, dr);
-			set.imageAt(x, y).displacements[DISP_RIGHT] = dr;
-			set.imageAt(x, y, DISP_RIGHT).displacements[DISP_LEFT] = -dr;
-		}
-		progress(STEP_OVERLAPSX, x, set.gridWidth - 1, "Computing overlaps");
-	}
+	Point2f stagePos = set.stagePositionAt(gB) - set.stagePositionAt(gA);
+	Vec2f gv = set.affineStageToImage * Vec3f(stagePos.x, stagePos.y, 1.);
+	return Point2i(gv[0], gv[1]);
 }
 
 /**
@@ -138,8 +38,8 @@ float AffineOverlapSolver::computeMatrix(ScanSet& set, int x, int y)
 	/* Compute stage displacement */
 	Point2f s[3];
 	s[0] = Point2f(0, 0);
-	s[1] = Point2f(set.imageAt(x, y, d1).stagePosition - set.imageAt(x, y).stagePosition);
-	s[2] = Point2f(set.imageAt(x, y, d2).stagePosition - set.imageAt(x, y).stagePosition);
+	s[1] = Point2f(set.stagePositionAt(Point2i(x, y) + DISP_DIRECTIONS[d1]) - set.stagePositionAt(x, y));
+	s[2] = Point2f(set.stagePositionAt(Point2i(x, y) + DISP_DIRECTIONS[d2]) - set.stagePositionAt(x, y));
 
 	progress(STEP_GRIDVEC, 0, 3, "Computing pair 1 overlap");
 
@@ -161,35 +61,47 @@ float AffineOverlapSolver::computeMatrix(ScanSet& set, int x, int y)
 	return score_b + score_c;
 }
 
-void AffineOverlapSolver::setFixedGuess(cv::Point2i guessH, cv::Point2i guessV)
-{
-	this->guessMode = GUESS_FIXED;
-	this->guessH = guessH;
-	this->guessV = guessV;
-}
-
-void AffineOverlapSolver::setParameters(int guessMode, int maxDist, int logSteps, cv::Size cropSize, cv::Point2i rangeH, cv::Point2i rangeV)
+/**
+ * Calibrates the stage to image matrix from many pairs instead of the two
+ * used by computeMatrix, so that a single featureless or repetitive pair can
+ * not throw it off. See fitSampledPairs for how the pairs are measured and
+ * fitted.
+ *
+ * The spread of the fit tells how far the stage guesses can be off, later
+ * searches can use a small multiple of it as their range.
+ */
+MatrixFit AffineOverlapSolver::computeMatrixSampled(ScanSet& set, int samples, float maxError)
 {
-	this->guessMode = guessMode;
-	this->maxDistance = maxDist;
-	this->logSteps = logSteps;
-	this->cropSize = cropSize;
-	this->rangeH = rangeH;
-	this->rangeV = rangeV;
+	MatrixFit fit;
+	Matx22d m;
+
+	if (!fitSampledPairs(set, samples, maxError, false, fit, m))
+		return fit;
+	set.affineStageToImage = Matx23f((float)m(0, 0), (float)m(0, 1), 0.f,
+	                                 (float)m(1, 0), (float)m(1, 1), 0.f);
+	progress(STEP_GRIDVEC, 1, 1, "Computed affine matrix");
+	logf(SLOG_INFO, "Calibrated from %i of %i pairs, residual rms %.2f px, spread (%.1f, %.1f) px",
+	     fit.inliers, fit.samples, fit.rms, fit.spread.x, fit.spread.y);
+	logf(SLOG_INFO, "Affine map: [%g, %g; %g, %g]", m(0, 0), m(0, 1), m(1, 0), m(1, 1));
+	return fit;
 }
 
 void AffineOverlapSolver::computeResidual(ScanSet& set, cv::Mat& mat) {
 	Point2f stagePos;
 	mat.create(set.gridHeight, set.gridWidth, CV_32F);
-	Point2i stitchOrigin = set.imageAt(0, 0).stitchPosition;
+	Point2i stitchOrigin = set.stitchPositionAt(0, 0);
 	cv::Matx23f imageToStageAffine;
 	invertAffineTransform(set.affineStageToImage, imageToStageAffine);
-	for (int x = 0; x < set.gridWidth; x++) {
-		for (int y = 0; y < set.gridHeight; y++) {
-			stagePos = set.imageAt(x, y).stitchPosition - stitchOrigin;
-			Vec2f gv = imageToStageAffine * Vec3f(stagePos.x, stagePos.y, 1.) - Vec2f(set.imageAt(x, y).stagePosition - set.stageOrigin);
-			mat.at<float>(Point(x, y)) = sqrt(gv.dot(gv));
-		}
+
+	/* Tiles are stored in row-major grid order, the same layout as mat */
+	const Point2i* stitchPos = set.stitchPositions.data();
+	const Point2f* stagePosArr = set.stagePositions.data();
+	float* out = mat.ptr<float>();
+	int n = set.gridWidth * set.gridHeight;
+	for (int i = 0; i < n; i++) {
+		stagePos = stitchPos[i] - stitchOrigin;
+		Vec2f gv = imageToStageAffine * Vec3f(stagePos.x, stagePos.y, 1.) - Vec2f(stagePosArr[i] - set.stageOrigin);
+		out[i] = sqrt(gv.dot(gv));
 	}
 	double mi, ma;
 	minMaxLoc(mat, &mi, &ma);
@@ -197,16 +109,25 @@ void AffineOverlapSolver::computeResidual(ScanSet& set, cv::Mat& mat) {
 }
 
 void AffineOverlapSolver::applyInitialGrid(ScanSet& set) {
-	for (int y = 0; y < set.gridHeight; y++) {
-		for (int x = 0; x < set.gridWidth; x++) {
-			Point2i pos = Point(x, y);
-			Point2d stagePos = set.imageAt(pos).stagePosition - set.stageOrigin;
-			Vec2f gv = set.affineStageToImage * Vec3f(stagePos.x, stagePos.y, 1.);
-			set.imageAt(pos).stitchPosition = Point2i(gv[0], gv[1]);
-		}
+	const Matx23f& m = set.affineStageToImage;
+	const Point2f* stagePos = set.stagePositions.data();
+	Point2i* stitchPos = set.stitchPositions.data();
+	int n = set.gridWidth * set.gridHeight;
+	for (int i = 0; i < n; i++) {
+		float sx = stagePos[i].x - set.stageOrigin.x;
+		float sy = stagePos[i].y - set.stageOrigin.y;
+		stitchPos[i].x = (int)(m(0, 0) * sx + m(0, 1) * sy + m(0, 2));
+		stitchPos[i].y = (int)(m(1, 0) * sx + m(1, 1) * sy + m(1, 2));
 	}
 }
 
+cv::Point2i AffineOverlapSolver::initialPosition(ScanSet& set, cv::Point2i g)
+{
+	Point2f stagePos = set.stagePositionAt(g) - set.stageOrigin;
+	Vec2f gv = set.affineStageToImage * Vec3f(stagePos.x, stagePos.y, 1.);
+	return Point2i(gv[0], gv[1]);
+}
+
 void AffineOverlapSolver::computeMatrixFromStitch(ScanSet& set, Point2i ta, Point2i tb, Point2i tc)
 {
 	int d1 = DISP_DOWN, d2 = DISP_RIGHT;
@@ -214,12 +135,12 @@ void AffineOverlapSolver::computeMatrixFromStitch(ScanSet& set, Point2i ta, Poin
 	/* Compute stage displacement */
 	Point2f s[3];
 	s[0] = Point2f(0,0);
-	s[1] = Point2f(set.imageAt(tb).stagePosition - set.imageAt(ta).stagePosition);
-	s[2] = Point2f(set.imageAt(tc).stagePosition - set.imageAt(ta).stagePosition);
+	s[1] = Point2f(set.stagePositionAt(tb) - set.stagePositionAt(ta));
+	s[2] = Point2f(set.stagePositionAt(tc) - set.stagePositionAt(ta));
 
-	Point2i spOrigin = set.imageAt(ta).stitchPosition;
+	Point2i spOrigin = set.stitchPositionAt(ta);
 	Point2i p[3];
-	Point2f pd[3] = { Point2f(0,0), set.imageAt(tb).stitchPosition - spOrigin, set.imageAt(tc).stitchPosition - spOrigin };
+	Point2f pd[3] = { Point2f(0,0), set.stitchPositionAt(tb) - spOrigin, set.stitchPositionAt(tc) - spOrigin };
 
 	set.affineStageToImage = getAffineTransform(s, pd);
 	std::cout << "Affine map:" << std::endl;
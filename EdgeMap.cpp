@@ -0,0 +1,146 @@
+#include "pch.h"
+#include "EdgeMap.h"
+#include <algorithm>
+#include <cmath>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace cv;
+
+static inline int popcount64(uint64_t v)
+{
+#ifdef _MSC_VER
+	return (int)__popcnt64(v);
+#else
+	return __builtin_popcountll(v);
+#endif
+}
+
+/**
+ * Gradient magnitude of row y as |dx| + |dy|, forward differences.
+ * @return the sum of the row
+ */
+template<typename T>
+static double gradientRow(const Mat& image, int y, float* g)
+{
+	const T* p = image.ptr<T>(y);
+	const T* q = image.ptr<T>(y + 1 < image.rows ? y + 1 : y);
+	int w = image.cols;
+	double sum = 0;
+
+	for (int x = 0; x < w - 1; x++) {
+		g[x] = fabsf((float)p[x + 1] - (float)p[x]) + fabsf((float)q[x] - (float)p[x]);
+		sum += g[x];
+	}
+	g[w - 1] = fabsf((float)q[w - 1] - (float)p[w - 1]);
+	return sum + g[w - 1];
+}
+
+/**
+ * Computes the gradient magnitude of a single channel image into gradient
+ * (CV_32F), see gradientRow.
+ * @return the mean gradient, or -1 for an empty or multi channel image
+ */
+double gradientMagnitude(const cv::Mat& image, cv::Mat& gradient)
+{
+	Mat src = image;
+	double sum = 0;
+
+	if (image.empty() || image.channels() != 1)
+		return -1;
+	if (image.depth() != CV_8U && image.depth() != CV_16U && image.depth() != CV_32F)
+		image.convertTo(src, CV_32F);
+
+	gradient.create(src.rows, src.cols, CV_32F);
+	for (int y = 0; y < src.rows; y++) {
+		float* g = gradient.ptr<float>(y);
+		switch (src.depth()) {
+		case CV_8U:  sum += gradientRow<uint8_t>(src, y, g);  break;
+		case CV_16U: sum += gradientRow<uint16_t>(src, y, g); break;
+		default:     sum += gradientRow<float>(src, y, g);    break;
+		}
+	}
+	return sum / ((double)src.cols * src.rows);
+}
+
+/**
+ * Builds the map of a single channel image.
+ * @param gradient  Scratch buffer for the gradient magnitudes
+ * @param storage   Buffer the bits are written to, bits refers to it afterwards
+ * @return false for an empty or multi channel image
+ */
+bool EdgeMap::build(const cv::Mat& image, cv::Mat& gradient, cv::Mat& storage, float edgeScale)
+{
+	double mean = gradientMagnitude(image, gradient);
+
+	if (mean < 0)
+		return false;
+	width  = image.cols;
+	height = image.rows;
+
+	/* Flat images get no edges rather than noise */
+	float threshold = (float)(edgeScale * mean);
+	if (threshold <= 0)
+		threshold = INFINITY;
+
+	int words = (width + 63) / 64;
+	storage.create(height, words + 1, CV_32SC2);
+	for (int y = 0; y < height; y++) {
+		const float* g = gradient.ptr<float>(y);
+		uint64_t* out = (uint64_t*)storage.ptr(y);
+		for (int k = 0; k < words; k++) {
+			int n = std::min(64, width - 64 * k);
+			uint64_t word = 0;
+			for (int j = 0; j < n; j++)
+				word |= (uint64_t)(g[64 * k + j] > threshold) << j;
+			out[k] = word;
+		}
+		out[words] = 0;
+	}
+	bits = storage;
+	return true;
+}
+
+/** The 64 bits of row starting at bit pos */
+static inline uint64_t bitsAt(const uint64_t* row, int pos)
+{
+	int i = pos >> 6, s = pos & 63;
+
+	return s ? (row[i] >> s) | (row[i + 1] << (64 - s)) : row[i];
+}
+
+/**
+ * Scores placing b at dr relative to a, as the fraction of the edges in the
+ * overlap that both maps share: both / (both + differing), where differing
+ * is the XOR of the maps. Overlaps with few edges score lower, so a tiny
+ * overlap can not win on a handful of bits.
+ * @return score in [0, 1), higher is better, 0 if the maps do not overlap
+ */
+float scoreEdgeOverlap(const EdgeMap& a, const EdgeMap& b, cv::Point2i dr)
+{
+	Point2i sa(std::max(dr.x, 0), std::max(dr.y, 0));
+	Point2i sb(std::max(-dr.x, 0), std::max(-dr.y, 0));
+	int w = std::min(a.width - sa.x, b.width - sb.x);
+	int h = std::min(a.height - sa.y, b.height - sb.y);
+	int64_t both = 0, diff = 0;
+
+	if (w <= 0 || h <= 0)
+		return 0;
+
+	uint64_t lastMask = (w & 63) ? ((uint64_t)1 << (w & 63)) - 1 : ~(uint64_t)0;
+	int full = (w - 1) >> 6;
+	for (int y = 0; y < h; y++) {
+		const uint64_t* ra = a.row(sa.y + y);
+		const uint64_t* rb = b.row(sb.y + y);
+		for (int k = 0; k < full; k++) {
+			uint64_t wa = bitsAt(ra, sa.x + 64 * k), wb = bitsAt(rb, sb.x + 64 * k);
+			both += popcount64(wa & wb);
+			diff += popcount64(wa ^ wb);
+		}
+		uint64_t wa = bitsAt(ra, sa.x + 64 * full) & lastMask, wb = bitsAt(rb, sb.x + 64 * full) & lastMask;
+		both += popcount64(wa & wb);
+		diff += popcount64(wa ^ wb);
+	}
+	return (float)((double)both / (double)(both + diff + EDGE_MIN_BITS));
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "stitchapi.h"
+#include <opencv2/core.hpp>
+#include <stdint.h>
+
+#define EDGE_SCALE    (2.f)   /* Edge threshold, in mean gradients of the image */
+#define EDGE_MIN_BITS (64)    /* Edge bits an overlap needs before its score counts fully */
+
+/**
+ * One bit per pixel map of the strong edges of an image, the input of the
+ * OVERLAP_ENGINE_EDGE overlap search. A pixel is an edge when its gradient
+ * magnitude is above edgeScale times the mean gradient of the image, so the
+ * map does not change with the brightness or gain of a tile.
+ *
+ * Rows are packed into 64 bit words, lowest bit first, and followed by a
+ * zero word so any 64 bit window of a row can be read from two words.
+ */
+struct STITCH_API EdgeMap
+{
+	cv::Mat bits;       /* CV_32SC2, one word per element */
+	int     width = 0;
+	int     height = 0;
+
+	bool build(const cv::Mat& image, cv::Mat& gradient, cv::Mat& storage, float edgeScale = EDGE_SCALE);
+	const uint64_t* row(int y) const { return (const uint64_t*)bits.ptr(y); }
+};
+
+STITCH_API double gradientMagnitude(const cv::Mat& image, cv::Mat& gradient);
+STITCH_API float scoreEdgeOverlap(const EdgeMap& a, const EdgeMap& b, cv::Point2i dr);
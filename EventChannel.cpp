@@ -0,0 +1,184 @@
+#include "pch.h"
+#include "EventChannel.h"
+#include "Solver.h"
+#include "OverlapCache.h"
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+
+static int64_t nowUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+EventChannel::EventChannel() : enqueuePos(0), delivered(0), droppedEvents(0), sleeping(false), repeatInterval(1000000)
+{
+	for (size_t i = 0; i < EVENT_RING_SIZE; i++)
+		cells[i].seq.store(i, std::memory_order_relaxed);
+	consumer = std::thread(&EventChannel::consumerMain, this);
+}
+
+EventChannel::~EventChannel()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	consumer.join();
+}
+
+/**
+ * Blocks until every event posted before the call has been delivered, and
+ * delivers the summaries of the repeats held back for solver, or for every
+ * solver if it is null. Solvers call this when they finish a job, and
+ * through forget when they are destroyed.
+ */
+void EventChannel::flush(Solver* solver)
+{
+	/* A callback flushing would wait for itself */
+	if (std::this_thread::get_id() == consumer.get_id())
+		return;
+
+	size_t target = enqueuePos.load(std::memory_order_acquire);
+	std::unique_lock<std::mutex> guard(lock);
+	flushRequests.push_back(solver);
+	uint64_t ticket = ++flushRequested;
+	flushWaiters++;
+	wake.notify_one();
+	flushed.wait(guard, [&] { return flushServed >= ticket && delivered.load() >= target; });
+	flushWaiters--;
+}
+
+/**
+ * Makes sure no event is delivered to solver once the call returns. Solvers
+ * call this when they are destroyed, which may happen inside one of their
+ * own callbacks, where flush can not wait.
+ */
+void EventChannel::forget(Solver* solver)
+{
+	if (std::this_thread::get_id() != consumer.get_id()) {
+		/* Delivers what is queued and drops the solver's held back repeats */
+		flush(solver);
+		return;
+	}
+
+	for (auto it = repeats.begin(); it != repeats.end();) {
+		if (it->second.solver == solver)
+			it = repeats.erase(it);
+		else
+			++it;
+	}
+	/* Only the consumer reads published records, so they can be changed */
+	for (size_t pos = dequeuePos;; pos++) {
+		Cell& cell = cells[pos & (EVENT_RING_SIZE - 1)];
+		if (cell.seq.load(std::memory_order_acquire) != pos + 1)
+			break;
+		if (cell.event.solver == solver)
+			cell.event.solver = nullptr;
+	}
+}
+
+void EventChannel::consumerMain()
+{
+	SolverEvent event;
+
+	for (;;) {
+		/* Deliver everything that is ready, in order */
+		for (;;) {
+			Cell& cell = cells[dequeuePos & (EVENT_RING_SIZE - 1)];
+			if (cell.seq.load(std::memory_order_acquire) != dequeuePos + 1)
+				break;
+			event = cell.event;
+			cell.seq.store(dequeuePos + EVENT_RING_SIZE, std::memory_order_release);
+			dequeuePos++;
+			deliver(event);
+			delivered.store(dequeuePos, std::memory_order_release);
+		}
+
+		std::unique_lock<std::mutex> guard(lock);
+		if (!flushRequests.empty()) {
+			std::vector<Solver*> solvers;
+			uint64_t served = flushRequested;
+			solvers.swap(flushRequests);
+			guard.unlock();
+			summarizeRepeats(solvers);
+			guard.lock();
+			flushServed = served;
+		}
+		/* Waiters also need the events still being written */
+		if (flushWaiters)
+			flushed.notify_all();
+		if (stopping && cells[dequeuePos & (EVENT_RING_SIZE - 1)].seq.load() != dequeuePos + 1)
+			break;
+		/* Producers only signal when we sleep, the timeout covers a signal
+		 * that raced with going to sleep */
+		sleeping.store(true);
+		if (cells[dequeuePos & (EVENT_RING_SIZE - 1)].seq.load() != dequeuePos + 1 && !flushWaiters)
+			wake.wait_for(guard, std::chrono::milliseconds(20));
+		sleeping.store(false);
+	}
+}
+
+void EventChannel::deliver(SolverEvent& event)
+{
+	/* The solver was destroyed after posting it */
+	if (!event.solver)
+		return;
+	if (event.kind == EVENT_PROGRESS) {
+		event.solver->deliverProgress(event.level, event.n, event.nmax, event.text);
+		return;
+	}
+
+	int64_t interval = repeatInterval.load(std::memory_order_relaxed);
+	if (event.level >= SLOG_WARN && interval > 0) {
+		uint64_t k = event.key ? (uint64_t)(uintptr_t)event.key : hashBytes(event.text, strlen(event.text), 0);
+		k = hashBytes(&event.solver, sizeof event.solver, k);
+		int64_t now = nowUs();
+		Repeat& r = repeats[k];
+		if (r.solver && now - r.last < interval) {
+			r.suppressed++;
+			r.text = event.text;
+			return;
+		}
+		r.solver = event.solver;
+		r.level  = event.level;
+		r.last   = now;
+		if (r.suppressed) {
+			std::string message = std::string(event.text) + " (" + std::to_string(r.suppressed) +
+			                      " similar messages suppressed)";
+			r.suppressed = 0;
+			event.solver->deliverLog(event.level, message);
+			return;
+		}
+	}
+	event.solver->deliverLog(event.level, event.text);
+}
+
+/**
+ * Reports the repeats held back for the listed solvers (all of them if one
+ * is null) and forgets those, so that no entry outlives a solver that
+ * flushed before going away. Other solvers keep their rate limiting.
+ */
+void EventChannel::summarizeRepeats(const std::vector<Solver*>& solvers)
+{
+	bool all = std::find(solvers.begin(), solvers.end(), nullptr) != solvers.end();
+
+	for (auto it = repeats.begin(); it != repeats.end();) {
+		Repeat& r = it->second;
+		if (!all && std::find(solvers.begin(), solvers.end(), r.solver) == solvers.end()) {
+			++it;
+			continue;
+		}
+		if (r.suppressed)
+			r.solver->deliverLog(r.level, std::to_string(r.suppressed) + " similar messages suppressed, last: " + r.text);
+		it = repeats.erase(it);
+	}
+}
+
+EventChannel& eventChannel()
+{
+	static EventChannel channel;
+	return channel;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "stitchapi.h"
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class Solver;
+
+#define EVENT_LOG      (0)
+#define EVENT_PROGRESS (1)
+
+#define EVENT_TEXT_SIZE  (224)
+#define EVENT_RING_SIZE  (1024)   /* Records, must be a power of two */
+
+/**
+ * Fixed size record of one log message or progress update.
+ */
+struct SolverEvent
+{
+	Solver*     solver;
+	int         kind;      /* EVENT_LOG or EVENT_PROGRESS */
+	int         level;     /* Log level, or progress step */
+	int         n;
+	int         nmax;
+	const void* key;       /* Groups repeats of a message (its format string), null to use the text */
+	char        text[EVENT_TEXT_SIZE];
+};
+
+/**
+ * Delivers the log and progress events of all solvers to their callbacks
+ * from a single thread, so callbacks never run concurrently and never slow
+ * down the threads doing the work.
+ *
+ * Events are written into a bounded lock free ring of preformatted records.
+ * Posting never blocks or allocates: when the ring is full the event is
+ * dropped and counted. Warnings and errors that repeat within the repeat
+ * interval are held back and summarised.
+ */
+class STITCH_API EventChannel
+{
+public:
+	EventChannel();
+	~EventChannel();
+
+	template<typename Fill>
+	bool post(Fill fill);
+
+	void flush(Solver* solver = nullptr);
+	void forget(Solver* solver);
+	void setRepeatInterval(double seconds) { repeatInterval = (int64_t)(seconds * 1e6); }
+	uint64_t dropped() const { return droppedEvents.load(std::memory_order_relaxed); }
+private:
+	struct Cell {
+		std::atomic<size_t> seq;
+		SolverEvent         event;
+	};
+	/* Consumer side state of a repeating message */
+	struct Repeat {
+		int64_t     last = 0;
+		int         suppressed = 0;
+		Solver*     solver = nullptr;
+		int         level = 0;
+		std::string text;
+	};
+	void consumerMain();
+	void deliver(SolverEvent& event);
+	void summarizeRepeats(const std::vector<Solver*>& solvers);
+
+	Cell                    cells[EVENT_RING_SIZE];
+	std::atomic<size_t>     enqueuePos;
+	std::atomic<size_t>     delivered;
+	size_t                  dequeuePos = 0;
+	std::atomic<uint64_t>   droppedEvents;
+	std::atomic<bool>       sleeping;
+	std::atomic<int64_t>    repeatInterval;
+	bool                    stopping = false;
+	std::mutex              lock;
+	std::condition_variable wake;
+	std::condition_variable flushed;
+	std::vector<Solver*>    flushRequests;   /* Solvers whose repeats a flush waits for, null for all */
+	uint64_t                flushRequested = 0;
+	uint64_t                flushServed = 0;
+	int                     flushWaiters = 0;
+	std::unordered_map<uint64_t, Repeat> repeats;
+	std::thread             consumer;
+};
+
+/**
+ * Claims a record, lets fill write it and hands it to the consumer.
+ * @return false if the ring was full and the event was dropped
+ */
+template<typename Fill>
+bool EventChannel::post(Fill fill)
+{
+	size_t pos = enqueuePos.load(std::memory_order_relaxed);
+	Cell* cell;
+
+	for (;;) {
+		cell = &cells[pos & (EVENT_RING_SIZE - 1)];
+		size_t seq = cell->seq.load(std::memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		}
+		else if (dif < 0) {
+			droppedEvents.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		else
+			pos = enqueuePos.load(std::memory_order_relaxed);
+	}
+	fill(cell->event);
+	cell->seq.store(pos + 1, std::memory_order_release);
+	if (sleeping.load(std::memory_order_acquire))
+		wake.notify_one();
+	return true;
+}
+
+/** The channel shared by all solvers, started on first use */
+STITCH_API EventChannel& eventChannel();
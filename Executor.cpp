@@ -0,0 +1,138 @@
+#include "pch.h"
+#include "Executor.h"
+#include <atomic>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/**
+ * One parallelFor call. Items are claimed by incrementing next, the caller
+ * waits until done reaches the number of items.
+ */
+struct ThreadPool::Batch
+{
+	const std::function<void(int)>* fn;
+	int                             begin;
+	int                             end;
+	std::atomic<int>                next;
+	std::atomic<int>                done;
+	std::mutex                      lock;
+	std::condition_variable         finished;
+};
+
+void SerialExecutor::parallelFor(int begin, int end, const std::function<void(int)>& fn)
+{
+	for (int i = begin; i < end; i++)
+		fn(i);
+}
+
+ThreadPool::ThreadPool(int numThreads, const std::vector<int>& cores) : cores(cores), idle(0)
+{
+	if (numThreads <= 0)
+		numThreads = (int)std::thread::hardware_concurrency();
+	if (numThreads <= 0)
+		numThreads = 1;
+
+	/* The caller of parallelFor is one of the threads */
+	for (int i = 0; i < numThreads - 1; i++)
+		workers.emplace_back(&ThreadPool::workerMain, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& t : workers)
+		t.join();
+}
+
+/**
+ * Works on batch until no unclaimed items are left.
+ * @return true if this call completed the last item of the batch
+ */
+bool ThreadPool::runItems(Batch& batch)
+{
+	int n = batch.end - batch.begin, i, count = 0;
+	bool last = false;
+
+	while ((i = batch.next.fetch_add(1)) < n) {
+		(*batch.fn)(batch.begin + i);
+		count++;
+	}
+	if (count)
+		last = batch.done.fetch_add(count) + count == n;
+	return last;
+}
+
+void ThreadPool::workerMain(int index)
+{
+#ifdef __linux__
+	if (!cores.empty()) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cores[index % cores.size()], &set);
+		pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+	}
+#endif
+	for (;;) {
+		std::shared_ptr<Batch> batch;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			idle++;
+			wake.wait(guard, [this] { return stopping || !queue.empty(); });
+			idle--;
+			if (queue.empty())
+				return;
+			batch = queue.front();
+			/* Exhausted batches leave the queue, their callers finish them */
+			if (batch->next.load() >= batch->end - batch->begin) {
+				queue.pop_front();
+				continue;
+			}
+		}
+		if (runItems(*batch)) {
+			std::lock_guard<std::mutex> guard(batch->lock);
+			batch->finished.notify_all();
+		}
+	}
+}
+
+void ThreadPool::parallelFor(int begin, int end, const std::function<void(int)>& fn)
+{
+	int n = end - begin;
+
+	if (n <= 0)
+		return;
+	if (n == 1 || workers.empty()) {
+		for (int i = begin; i < end; i++)
+			fn(i);
+		return;
+	}
+
+	std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+	batch->fn    = &fn;
+	batch->begin = begin;
+	batch->end   = end;
+	batch->next  = 0;
+	batch->done  = 0;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		queue.push_back(batch);
+	}
+	wake.notify_all();
+
+	runItems(*batch);
+
+	std::unique_lock<std::mutex> guard(batch->lock);
+	batch->finished.wait(guard, [&] { return batch->done.load() == n; });
+}
+
+Executor& defaultExecutor()
+{
+	static ThreadPool pool;
+	return pool;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "stitchapi.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Runs the parallel loops of the solvers. Applications embedding the library
+ * can implement this to schedule solver work on their own threads, or share
+ * one ThreadPool between several solvers to bound the cores they use.
+ */
+class STITCH_API Executor
+{
+public:
+	virtual ~Executor() {}
+
+	/**
+	 * Calls fn(i) for every i in [begin, end), in any order and possibly
+	 * concurrently, and returns when all calls have completed. Must be safe
+	 * to call from several threads at once, and from inside fn.
+	 */
+	virtual void parallelFor(int begin, int end, const std::function<void(int)>& fn) = 0;
+
+	/** Number of loop iterations that can run at the same time */
+	virtual int concurrency() const = 0;
+
+	/**
+	 * Rough number of threads waiting for work right now. Loops nested in
+	 * the items of another loop use it to only split up when that would not
+	 * oversubscribe the executor. The default never splits.
+	 */
+	virtual int idleThreads() const { return 0; }
+};
+
+/**
+ * Runs everything on the calling thread.
+ */
+class STITCH_API SerialExecutor : public Executor
+{
+public:
+	void parallelFor(int begin, int end, const std::function<void(int)>& fn) override;
+	int concurrency() const override { return 1; }
+};
+
+/**
+ * Bounded pool of worker threads. The thread calling parallelFor takes part
+ * in its own loop, so a pool of N threads keeps at most N + (number of
+ * callers) cores busy and nested loops can not deadlock.
+ */
+class STITCH_API ThreadPool : public Executor
+{
+public:
+	/**
+	 * @param numThreads  Number of workers, 0 for one per hardware thread
+	 * @param cores       If not empty, worker i is pinned to cores[i % cores.size()]
+	 *                    (ignored on platforms without affinity support)
+	 */
+	explicit ThreadPool(int numThreads = 0, const std::vector<int>& cores = std::vector<int>());
+	~ThreadPool();
+
+	void parallelFor(int begin, int end, const std::function<void(int)>& fn) override;
+	int concurrency() const override { return (int)workers.size() + 1; }
+	int idleThreads() const override { return idle.load(std::memory_order_relaxed); }
+private:
+	struct Batch;
+
+	void workerMain(int index);
+	static bool runItems(Batch& batch);
+
+	std::vector<std::thread>             workers;
+	std::vector<int>                     cores;
+	std::mutex                           lock;
+	std::condition_variable              wake;
+	std::deque<std::shared_ptr<Batch>>   queue;
+	std::atomic<int>                     idle;
+	bool                                 stopping = false;
+};
+
+/**
+ * Process wide pool used by solvers that were not given an executor.
+ */
+STITCH_API Executor& defaultExecutor();
@@ -0,0 +1,136 @@
+#include "pch.h"
+#include "FlatField.h"
+#include "OverlapCache.h"
+#include <vector>
+
+using namespace cv;
+
+/**
+ * Computes the correction from the reference images.
+ * @param flat  Image of an empty, evenly lit field, or empty to only subtract dark
+ * @param dark  Image taken with the light blocked, or empty for none
+ * @return false if the two references do not have the same size and channels
+ */
+bool FlatField::setup(const cv::Mat& flat, const cv::Mat& dark)
+{
+	Mat f;
+
+	gain.release();
+	this->dark.release();
+	refHash = 0;
+	if (flat.empty() && dark.empty())
+		return true;
+	if (!flat.empty() && !dark.empty() && (flat.size() != dark.size() || flat.channels() != dark.channels()))
+		return false;
+
+	const Mat& ref = flat.empty() ? dark : flat;
+	int cn = ref.channels();
+	if (dark.empty())
+		this->dark = Mat::zeros(ref.size(), CV_32FC(cn));
+	else
+		dark.convertTo(this->dark, CV_32F);
+	if (flat.empty()) {
+		gain.create(ref.size(), CV_32FC(cn));
+		gain = Scalar::all(1);
+	}
+	else {
+		flat.convertTo(f, CV_32F);
+		f -= this->dark;
+		Scalar m = mean(f);
+		gain.create(ref.size(), CV_32FC(cn));
+		for (int y = 0; y < f.rows; y++) {
+			const float* d = f.ptr<float>(y);
+			float* g = gain.ptr<float>(y);
+			for (int i = 0; i < f.cols * cn; i++) {
+				float mc = (float)m[i % cn];
+				/* Dead pixels in the flat are left as they are */
+				g[i] = d[i] > 1e-3f * mc ? mc / d[i] : 1.f;
+			}
+		}
+	}
+
+	for (int y = 0; y < gain.rows; y++) {
+		refHash = hashBytes(gain.ptr(y), gain.cols * gain.elemSize(), refHash);
+		refHash = hashBytes(this->dark.ptr(y), this->dark.cols * this->dark.elemSize(), refHash);
+	}
+	return true;
+}
+
+/*
+ * The row kernels are kept free of calls and branches the compiler can not
+ * turn into selects, so they vectorise.
+ */
+template<typename T>
+static void correctRow(T* p, const float* dark, const float* gain, int n, float maxVal)
+{
+	for (int i = 0; i < n; i++) {
+		float v = ((float)p[i] - dark[i]) * gain[i];
+		v = v < 0.f ? 0.f : v;
+		v = v > maxVal ? maxVal : v;
+		p[i] = (T)(v + 0.5f);
+	}
+}
+
+static void correctRow(float* p, const float* dark, const float* gain, int n)
+{
+	for (int i = 0; i < n; i++)
+		p[i] = (p[i] - dark[i]) * gain[i];
+}
+
+/**
+ * Corrects image in place, in a single pass and keeping its type.
+ * @return false if image does not match the references in size
+ */
+bool FlatField::apply(cv::Mat& image) const
+{
+	std::vector<float> expanded;
+	int cn = image.channels();
+
+	if (gain.empty())
+		return true;
+	if (image.size() != gain.size())
+		return false;
+	if (gain.channels() != cn && gain.channels() != 1)
+		return false;
+
+	/* A single channel reference applies to every channel. It is spread
+	 * over the channels one row at a time, so the kernels keep walking
+	 * both arrays in step */
+	if (gain.channels() != cn)
+		expanded.resize(2 * image.cols * cn);
+
+	int n = image.cols * cn;
+	for (int y = 0; y < image.rows; y++) {
+		const float* dr = dark.ptr<float>(y);
+		const float* gr = gain.ptr<float>(y);
+		if (!expanded.empty()) {
+			float* de = expanded.data();
+			float* ge = de + n;
+			for (int i = 0; i < n; i++) {
+				de[i] = dr[i / cn];
+				ge[i] = gr[i / cn];
+			}
+			dr = de;
+			gr = ge;
+		}
+		switch (image.depth()) {
+		case CV_8U:
+			correctRow(image.ptr<uint8_t>(y), dr, gr, n, 255.f);
+			break;
+		case CV_16U:
+			correctRow(image.ptr<uint16_t>(y), dr, gr, n, 65535.f);
+			break;
+		case CV_32F:
+			correctRow(image.ptr<float>(y), dr, gr, n);
+			break;
+		default: {
+			/* Uncommon depths take the slow way */
+			Mat row, dst = image.row(y);
+			dst.convertTo(row, CV_32F);
+			correctRow(row.ptr<float>(), dr, gr, n);
+			row.convertTo(dst, image.depth());
+		}
+		}
+	}
+	return true;
+}
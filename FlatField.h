@@ -0,0 +1,28 @@
+#pragma once
+
+#include "stitchapi.h"
+#include <opencv2/core.hpp>
+#include <stdint.h>
+
+/**
+ * Flat-field and dark-frame correction, applied to tiles right after they
+ * are decoded (see ScanSet::setFlatField) so that the overlap solvers and the
+ * stitcher all see corrected pixels:
+ *
+ *   corrected = (raw - dark) * mean(flat - dark) / (flat - dark)
+ *
+ * The mean is taken per channel, so the overall brightness is kept.
+ */
+class STITCH_API FlatField
+{
+public:
+	bool setup(const cv::Mat& flat, const cv::Mat& dark);
+	bool apply(cv::Mat& image) const;
+
+	bool     empty() const { return gain.empty(); }
+	uint64_t hash() const { return refHash; }
+private:
+	cv::Mat  dark;     /* CV_32F, channels as given */
+	cv::Mat  gain;     /* CV_32F, channels as given */
+	uint64_t refHash = 0;
+};
@@ -0,0 +1,165 @@
+#include "pch.h"
+#include "LayerStackSolver.h"
+#include <assert.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace cv;
+
+/**
+ * Sets up solving a stack of layers.
+ * @param range          Search range around the previous layer's displacements
+ * @param maxSanityDiff  Passed on to the relaxation solver (see RelaxationSolver::setup)
+ * @param iters          Relaxation iterations per layer, few are needed as
+ *                       every layer starts from the previous solution
+ */
+void LayerStackSolver::setup(PairOverlapSolver& overlaps, RelaxationSolver& relax, cv::Point2i range, int maxSanityDiff, int iters)
+{
+	this->overlaps      = &overlaps;
+	this->relax         = &relax;
+	this->range         = range;
+	this->maxSanityDiff = maxSanityDiff;
+	this->iters         = iters;
+	previous  = nullptr;
+	numLayers = 0;
+}
+
+/**
+ * Re-measures the pairs of a layer that disagree with its solution by more
+ * than maxResidual pixels, with rangeScale times the layer range, and solves
+ * again (see PairOverlapSolver::remeasureOutliers). This catches pairs that
+ * moved further between layers than the small range allows. 0 disables it.
+ */
+void LayerStackSolver::setOutlierCheck(float maxResidual, float rangeScale)
+{
+	this->maxResidual = maxResidual;
+	this->rangeScale  = rangeScale;
+}
+
+/**
+ * Enables measuring the offset between consecutive layers on about samples
+ * tiles, searching range pixels around no offset. 0 samples disables it.
+ */
+void LayerStackSolver::setAlignment(int samples, cv::Point2i range)
+{
+	this->alignSamples = samples;
+	this->alignRange   = range;
+}
+
+/**
+ * Sets the solved layer the next call to solveLayer builds on. Its grid,
+ * calibration and stitch positions need to be final.
+ */
+void LayerStackSolver::setReference(ScanSet& set)
+{
+	previous    = &set;
+	offset      = Point2i(0, 0);
+	totalOffset = Point2i(0, 0);
+}
+
+/**
+ * Solves the next layer of the stack, which then becomes the reference for
+ * the one after it. The layer's grid is generated if that was not done yet.
+ * The overlap solver is left in GUESS_RESULT mode with the layer range.
+ * @return false if the layer grid does not match the previous one
+ */
+bool LayerStackSolver::solveLayer(ScanSet& layer)
+{
+	assert(overlaps != nullptr && relax != nullptr && previous != nullptr);
+	ScanSet& prev = *previous;
+
+	if (layer.gridWidth < 0 && !layer.generateGrid()) {
+		fatal("Layer tiles do not form a regular grid");
+		return false;
+	}
+	if (layer.gridWidth != prev.gridWidth || layer.gridHeight != prev.gridHeight ||
+	    layer.gridPositions != prev.gridPositions) {
+		fatal("Layer grid does not match the previous layer");
+		return false;
+	}
+	logf(SLOG_INFO, "Solving layer %i...", numLayers + 1);
+
+	/* Same stage grid, same calibration */
+	layer.affineStageToImage = prev.affineStageToImage;
+	layer.stageToImgX        = prev.stageToImgX;
+	layer.stageToImgY        = prev.stageToImgY;
+
+	/* The previous solution is both the guess for every pair and the
+	 * starting point of the relaxation */
+	layer.stitchPositions = prev.stitchPositions;
+	overlaps->setGuessMode(GUESS_RESULT);
+	overlaps->setRange(range, range);
+	overlaps->computeOverlapsY(layer);
+	overlaps->computeOverlapsX(layer);
+
+	relax->setup(layer, maxSanityDiff);
+	relax->run(iters);
+	if (maxResidual > 0 && overlaps->remeasureOutliers(layer, maxResidual, rangeScale) > 0) {
+		relax->setup(layer, maxSanityDiff);
+		relax->run(iters);
+	}
+
+	if (alignSamples > 0) {
+		offset = measureLayerOffset(prev, layer);
+		totalOffset += offset;
+		logf(SLOG_INFO, "Layer offset (%i, %i), to the first layer (%i, %i)",
+		     offset.x, offset.y, totalOffset.x, totalOffset.y);
+	}
+
+	/* Nothing reads the previous layer's tiles anymore */
+	for (ScanImage& img : prev.m_Images)
+		img.evictImage();
+
+	previous = &layer;
+	numLayers++;
+	return true;
+}
+
+static int medianOf(std::vector<int>& v)
+{
+	std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+	return v[v.size() / 2];
+}
+
+/**
+ * Measures the same tiles in both layers against each other.
+ * @return the median offset to add to a position in the layer mosaic to get
+ *         the matching position in the prev mosaic
+ */
+cv::Point2i LayerStackSolver::measureLayerOffset(ScanSet& prev, ScanSet& layer)
+{
+	int W = layer.gridWidth, H = layer.gridHeight;
+	int nx = std::max(1, std::min((int)lround(sqrt(alignSamples * (double)W / H)), W));
+	int ny = std::max(1, std::min((alignSamples + nx - 1) / nx, H));
+	std::vector<Point2i> tiles;
+
+	for (int iy = 0; iy < ny; iy++) {
+		for (int ix = 0; ix < nx; ix++) {
+			Point2i g((int)((ix + 0.5) * W / nx), (int)((iy + 0.5) * H / ny));
+			if (layer.hasTile(g) && prev.hasTile(g))
+				tiles.push_back(g);
+		}
+	}
+
+	std::vector<Point2i> found(tiles.size());
+	std::vector<float> scores(tiles.size());
+	executor().parallelFor(0, (int)tiles.size(), [&](int i) {
+		Point2i g = tiles[i];
+		scores[i] = overlaps->measureImages(prev.imageAt(g), layer.imageAt(g), Point2i(0, 0), alignRange, found[i]);
+	});
+
+	std::vector<int> ox, oy;
+	for (size_t i = 0; i < tiles.size(); i++) {
+		if (std::isnan(scores[i]) || scores[i] <= 0)
+			continue;
+		Point2i o = prev.stitchPositionAt(tiles[i]) - layer.stitchPositionAt(tiles[i]) + found[i];
+		ox.push_back(o.x);
+		oy.push_back(o.y);
+	}
+	if (ox.empty()) {
+		log(SLOG_WARN, "Could not measure the offset to the previous layer");
+		return Point2i(0, 0);
+	}
+	return Point2i(medianOf(ox), medianOf(oy));
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "stitchapi.h"
+#include "Solver.h"
+#include "scanset.h"
+#include "PairOverlapSolver.h"
+#include "RelaxationSolver.h"
+
+/**
+ * Solves a stack of layers imaged on the same stage grid, such as the
+ * delayered layers of a die. The first layer is solved the usual way and
+ * handed to setReference, every following layer goes through solveLayer,
+ * which builds on the layer before it:
+ *  - the stage calibration is copied instead of measured
+ *  - every pair is searched in a small range around the displacement solved
+ *    for the previous layer (GUESS_RESULT)
+ *  - the relaxation starts from the previous solution
+ *  - optionally, the offset between the two layers is measured
+ *
+ * The same overlap and relaxation solvers, and with them their executor and
+ * cache, are used for the whole stack. Only the tiles of the current and the
+ * previous layer are kept in memory.
+ */
+class STITCH_API LayerStackSolver : public Solver
+{
+public:
+	void setup(PairOverlapSolver& overlaps, RelaxationSolver& relax, cv::Point2i range, int maxSanityDiff, int iters);
+	void setOutlierCheck(float maxResidual, float rangeScale);
+	void setAlignment(int samples, cv::Point2i range);
+	void setReference(ScanSet& set);
+	bool solveLayer(ScanSet& layer);
+
+	/** Offset of the last solved layer to the layer before it, see measureLayerOffset */
+	cv::Point2i layerOffset() const { return offset; }
+	/** Offset of the last solved layer to the reference layer */
+	cv::Point2i stackOffset() const { return totalOffset; }
+	int layersSolved() const { return numLayers; }
+private:
+	cv::Point2i measureLayerOffset(ScanSet& prev, ScanSet& layer);
+
+	PairOverlapSolver* overlaps = nullptr;
+	RelaxationSolver*  relax = nullptr;
+	ScanSet*           previous = nullptr;
+	cv::Point2i        range;
+	int                maxSanityDiff = -1;
+	int                iters = 0;
+	float              maxResidual = 0;
+	float              rangeScale = 4.f;
+	int                alignSamples = 0;
+	cv::Point2i        alignRange;
+	cv::Point2i        offset;
+	cv::Point2i        totalOffset;
+	int                numLayers = 0;
+};
@@ -0,0 +1,97 @@
+#include "pch.h"
+#include "LiveSolver.h"
+#include <assert.h>
+
+using namespace cv;
+
+/**
+ * Sets up live solving on a scan set with a declared grid.
+ * @param maxSanityDiff  Passed on to the relaxation solver (see RelaxationSolver::setup)
+ * @param radius         Size of the neighbourhood around each new tile that gets relaxed
+ * @param iters          Number of local relaxation iterations per new tile
+ */
+void LiveSolver::setup(ScanSet& set, PairOverlapSolver& overlaps, RelaxationSolver& relax, int maxSanityDiff, int radius, int iters)
+{
+	assert(set.isLive());
+	this->set      = &set;
+	this->overlaps = &overlaps;
+	this->relax    = &relax;
+	this->radius   = radius;
+	this->iters    = iters;
+	numTiles  = 0;
+	normSum   = 0;
+	normCount = 0;
+	relax.setupLive(set, maxSanityDiff);
+}
+
+/**
+ * Adds a freshly acquired tile, measures it against its present neighbours
+ * and relaxes its neighbourhood.
+ */
+void LiveSolver::addTile(std::string path, cv::Point2i gridPosition, cv::Point2f stagePosition)
+{
+	assert(set != nullptr);
+	set->addImage(path, gridPosition, stagePosition);
+	solveTile(gridPosition);
+}
+
+/**
+ * Adds a freshly acquired tile that is held in memory (see ScanSet::addImage).
+ */
+void LiveSolver::addTile(cv::Mat&& image, cv::Point2i gridPosition, cv::Point2f stagePosition)
+{
+	assert(set != nullptr);
+	set->addImage(std::move(image), gridPosition, stagePosition);
+	solveTile(gridPosition);
+}
+
+void LiveSolver::solveTile(cv::Point2i gridPosition)
+{
+	static const int opposite[4] = { DISP_DOWN, DISP_UP, DISP_RIGHT, DISP_LEFT };
+	Point2i g = set->gridSlot(gridPosition);
+	Point2d acc(0, 0);
+	int n = 0;
+
+	/* Place the tile where the stage says it is, this is also the guess
+	 * used for GUESS_RESULT */
+	set->stitchPositionAt(g) = overlaps->initialPosition(*set, g);
+
+	/* Measure against every neighbour that is already there. Pairs are
+	 * always measured in the DOWN/RIGHT orientation, like the batch solver */
+	for (int d = 0; d < 4; d++) {
+		if (!set->hasImageAt(g, d) || !set->hasTile(g + DISP_DIRECTIONS[d]))
+			continue;
+		if (d == DISP_UP || d == DISP_LEFT)
+			overlaps->measurePair(*set, g.x + DISP_DIRECTIONS[d].x, g.y + DISP_DIRECTIONS[d].y, opposite[d]);
+		else
+			overlaps->measurePair(*set, g.x, g.y, d);
+		normSum += norm(set->displacementAt(g, d));
+		normCount++;
+	}
+
+	/* Warm start from the positions implied by the neighbours */
+	for (int d = 0; d < 4; d++) {
+		if (!set->hasImageAt(g, d) || !set->hasDisplacement(g, d))
+			continue;
+		acc += Point2d(set->stitchPositionAt(g + DISP_DIRECTIONS[d]) - set->displacementAt(g, d));
+		n++;
+	}
+	relax->setPosition(g, n ? acc / n : Point2d(set->stitchPositionAt(g)));
+
+	if (normCount)
+		relax->setSanityNorm((int)(normSum / normCount));
+	relax->runLocal(Rect(g - Point2i(radius, radius), g + Point2i(radius + 1, radius + 1)), iters);
+
+	numTiles++;
+	progress(STEP_LIVE_TILE, numTiles, set->gridWidth * set->gridHeight, "Added tile");
+}
+
+/**
+ * Runs a final global relaxation, starting from the live solution.
+ */
+void LiveSolver::finish(int iters)
+{
+	assert(set != nullptr);
+	log(SLOG_INFO, "Live: acquisition finished after " + std::to_string(numTiles) + " tiles");
+	relax->run(iters);
+}
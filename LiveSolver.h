@@ -0,0 +1,41 @@
+#pragma once
+
+#include "stitchapi.h"
+#include "Solver.h"
+#include "scanset.h"
+#include "PairOverlapSolver.h"
+#include "RelaxationSolver.h"
+
+#define STEP_LIVE_TILE (4)
+
+/**
+ * Incremental solver for live acquisition. Tiles are pushed as they come off
+ * the microscope, the overlaps with any neighbours already present are
+ * measured right away and the neighbourhood of the new tile is relaxed, so a
+ * near final solution is available as soon as the last tile arrives.
+ *
+ * The grid needs to be declared on the scan set (ScanSet::declareGrid) and
+ * the overlap solver needs its stage to image mapping and parameters set up
+ * before the first tile is added.
+ */
+class STITCH_API LiveSolver : public Solver
+{
+public:
+	void setup(ScanSet& set, PairOverlapSolver& overlaps, RelaxationSolver& relax, int maxSanityDiff, int radius, int iters);
+	void addTile(std::string path, cv::Point2i gridPosition, cv::Point2f stagePosition);
+	void addTile(cv::Mat&& image, cv::Point2i gridPosition, cv::Point2f stagePosition);
+	void finish(int iters);
+
+	int tilesAdded() const { return numTiles; }
+private:
+	void solveTile(cv::Point2i gridPosition);
+
+	ScanSet*           set = nullptr;
+	PairOverlapSolver* overlaps = nullptr;
+	RelaxationSolver*  relax = nullptr;
+	int                radius = 1;
+	int                iters = 0;
+	int                numTiles = 0;
+	double             normSum = 0;
+	int                normCount = 0;
+};
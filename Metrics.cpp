@@ -0,0 +1,89 @@
+#include "pch.h"
+#include "Metrics.h"
+
+/**
+ * Estimates a percentile (0..1) from the histogram buckets, returning the
+ * upper bound of the bucket it falls into.
+ */
+double HistogramSnapshot::percentile(double p) const
+{
+	uint64_t target = (uint64_t)(p * count), n = 0;
+
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		n += buckets[i];
+		if (n > target)
+			return (double)(1ULL << i);
+	}
+	return (double)(1ULL << (HIST_BUCKETS - 1));
+}
+
+void Metrics::record(int histogram, int64_t us)
+{
+	int b = 0;
+
+	if (us < 0)
+		us = 0;
+	while (b < HIST_BUCKETS - 1 && (1LL << b) <= us)
+		b++;
+	histCount[histogram].fetch_add(1, std::memory_order_relaxed);
+	histSum[histogram].fetch_add(us, std::memory_order_relaxed);
+	histBuckets[histogram][b].fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::snapshot(MetricsSnapshot& out) const
+{
+	for (int i = 0; i < METRIC_COUNT; i++)
+		out.counters[i] = counters[i].load(std::memory_order_relaxed);
+	for (int i = 0; i < GAUGE_COUNT; i++)
+		out.gauges[i] = gauges[i].load(std::memory_order_relaxed);
+	for (int h = 0; h < HIST_COUNT; h++) {
+		out.histograms[h].count = histCount[h].load(std::memory_order_relaxed);
+		out.histograms[h].sum   = histSum[h].load(std::memory_order_relaxed);
+		for (int b = 0; b < HIST_BUCKETS; b++)
+			out.histograms[h].buckets[b] = histBuckets[h][b].load(std::memory_order_relaxed);
+	}
+}
+
+void Metrics::reset()
+{
+	for (int i = 0; i < METRIC_COUNT; i++)
+		counters[i].store(0);
+	for (int i = 0; i < GAUGE_COUNT; i++)
+		gauges[i].store(0);
+	for (int h = 0; h < HIST_COUNT; h++) {
+		histCount[h].store(0);
+		histSum[h].store(0);
+		for (int b = 0; b < HIST_BUCKETS; b++)
+			histBuckets[h][b].store(0);
+	}
+}
+
+/**
+ * Sets a callback that is pushed a snapshot while solvers run.
+ * @param minInterval  Minimum time between pushes in seconds
+ */
+void Metrics::setCallback(metrics_cb_t cb, void* arg, double minInterval)
+{
+	std::lock_guard<std::mutex> guard(publishLock);
+	callback         = cb;
+	callbackArg      = arg;
+	callbackInterval = (int64_t)(minInterval * 1e6);
+	lastPublish      = 0;
+}
+
+/**
+ * Pushes a snapshot to the callback, unless one was pushed less than the
+ * configured interval ago. Solvers call this at natural checkpoints.
+ */
+void Metrics::publish(bool force)
+{
+	MetricsSnapshot snap;
+	int64_t t = now();
+
+	std::lock_guard<std::mutex> guard(publishLock);
+	if (!callback || (!force && t - lastPublish < callbackInterval))
+		return;
+	lastPublish = t;
+	snapshot(snap);
+	callback(callbackArg, snap);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "stitchapi.h"
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+/* Counters */
+#define METRIC_TILES_DECODED    (0)
+#define METRIC_BYTES_READ       (1)
+#define METRIC_CACHE_HITS       (2)
+#define METRIC_CACHE_MISSES     (3)
+#define METRIC_PAIRS_MEASURED   (4)
+#define METRIC_RELAX_ITERATIONS (5)
+#define METRIC_STITCH_TILES     (6)
+#define METRIC_STITCH_PIXELS    (7)
+#define METRIC_SCORE_EVALS      (8)   /* One counter per pyramid level, level 0 is full resolution */
+#define METRIC_MAX_LEVELS       (8)
+#define METRIC_PAIRS_WIDENED    (METRIC_SCORE_EVALS + METRIC_MAX_LEVELS)  /* Adaptive searches retried with the full range */
+#define METRIC_PAIRS_REMEASURED (METRIC_PAIRS_WIDENED + 1)    /* Outlier pairs measured again, see remeasureOutliers */
+#define METRIC_COUNT            (METRIC_PAIRS_REMEASURED + 1)
+
+/* Gauges, hold the last value set */
+#define GAUGE_RELAX_RESIDUAL    (0)
+#define GAUGE_STITCH_SECONDS    (1)
+#define GAUGE_COUNT             (2)
+
+/* Histograms of durations in microseconds */
+#define HIST_DECODE_US          (0)
+#define HIST_PAIR_US            (1)
+#define HIST_STITCH_TILE_US     (2)
+#define HIST_COUNT              (3)
+#define HIST_BUCKETS            (32)  /* Bucket i holds values below 2^i us */
+
+struct HistogramSnapshot
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[HIST_BUCKETS];
+
+	double mean() const { return count ? (double)sum / count : 0.0; }
+	double percentile(double p) const;
+};
+
+struct MetricsSnapshot
+{
+	uint64_t          counters[METRIC_COUNT];
+	double            gauges[GAUGE_COUNT];
+	HistogramSnapshot histograms[HIST_COUNT];
+};
+
+typedef void (*metrics_cb_t)(void* arg, const MetricsSnapshot& snapshot);
+
+/**
+ * Collects performance counters, gauges and duration histograms from the
+ * solvers and scan set it is attached to. All updates are lock free so the
+ * object can be shared between threads and between solvers.
+ *
+ * When no Metrics object is attached the instrumentation is skipped entirely,
+ * including the clock reads.
+ */
+class STITCH_API Metrics
+{
+public:
+	Metrics() { reset(); }
+
+	void add(int counter, uint64_t n = 1) { counters[counter].fetch_add(n, std::memory_order_relaxed); }
+	void set(int gauge, double value) { gauges[gauge].store(value, std::memory_order_relaxed); }
+	void record(int histogram, int64_t us);
+
+	void snapshot(MetricsSnapshot& out) const;
+	void reset();
+
+	void setCallback(metrics_cb_t cb, void* arg, double minInterval);
+	void publish(bool force = false);
+
+	static int64_t now() {
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+private:
+	std::atomic<uint64_t> counters[METRIC_COUNT];
+	std::atomic<double>   gauges[GAUGE_COUNT];
+	std::atomic<uint64_t> histCount[HIST_COUNT];
+	std::atomic<uint64_t> histSum[HIST_COUNT];
+	std::atomic<uint64_t> histBuckets[HIST_COUNT][HIST_BUCKETS];
+
+	std::mutex            publishLock;
+	metrics_cb_t          callback = nullptr;
+	void*                 callbackArg = nullptr;
+	int64_t               callbackInterval = 0;
+	int64_t               lastPublish = 0;
+};
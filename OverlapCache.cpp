@@ -0,0 +1,130 @@
+#include "pch.h"
+#include "OverlapCache.h"
+#include <algorithm>
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+
+using namespace cv;
+
+#define HASH_MUL (0x9E3779B97F4A7C15ULL)
+
+static inline uint64_t mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/**
+ * Fast non-cryptographic 64 bit hash. Large inputs may be hashed in pieces
+ * by passing the previous result as seed, as long as the pieces are split
+ * the same way every time.
+ */
+uint64_t hashBytes(const void* data, size_t len, uint64_t seed)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	uint64_t h = seed ^ (len * HASH_MUL);
+	uint64_t w;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		h = (h ^ mix64(w)) * HASH_MUL;
+	}
+	w = 0;
+	memcpy(&w, p, len);
+	h = (h ^ mix64(w)) * HASH_MUL;
+	return mix64(h);
+}
+
+uint64_t OverlapCache::pairKey(uint64_t hashA, uint64_t hashB, int dir, cv::Point2i guess, cv::Point2i range,
+                               int logSteps, cv::Size cropSize, int engine)
+{
+	int32_t params[] = { dir, guess.x, guess.y, range.x, range.y, logSteps, cropSize.width, cropSize.height, engine };
+	uint64_t h = hashBytes(&hashA, sizeof hashA, 0);
+	h = hashBytes(&hashB, sizeof hashB, h);
+	return hashBytes(params, sizeof params, h);
+}
+
+bool OverlapCache::lookup(uint64_t key, cv::Point2i& dr, float& score)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = entries.find(key);
+	if (it == entries.end())
+		return false;
+	dr    = it->second.dr;
+	score = it->second.score;
+	return true;
+}
+
+void OverlapCache::store(uint64_t key, cv::Point2i dr, float score)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	entries[key] = Entry{ dr, score };
+}
+
+void OverlapCache::clear()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	entries.clear();
+}
+
+size_t OverlapCache::size()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return entries.size();
+}
+
+/**
+ * Merges the entries stored in a cache file into this cache.
+ * @return false if the file could not be opened
+ */
+bool OverlapCache::load(std::string path)
+{
+	cv::FileStorage fs(path, cv::FileStorage::READ);
+	if (!fs.isOpened())
+		return false;
+	cv::FileNode node = fs["entries"];
+	std::lock_guard<std::mutex> guard(lock);
+	for (cv::FileNodeIterator it = node.begin(); it != node.end(); ++it) {
+		std::string key = (*it)["key"];
+		cv::FileNode dnode = (*it)["dr"];
+		Entry e;
+		e.dr    = Point2i((int)dnode[0], (int)dnode[1]);
+		e.score = (float)(*it)["score"];
+		entries[strtoull(key.c_str(), nullptr, 16)] = e;
+	}
+	fs.release();
+	return true;
+}
+
+void OverlapCache::save(std::string path)
+{
+	std::vector<uint64_t> keys;
+	char keyStr[17];
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	/* Sort so the same cache always produces the same file */
+	keys.reserve(entries.size());
+	for (auto& e : entries)
+		keys.push_back(e.first);
+	std::sort(keys.begin(), keys.end());
+
+	cv::FileStorage fs(path, cv::FileStorage::WRITE);
+	fs << "entries" << "[";
+	for (uint64_t k : keys) {
+		Entry& e = entries[k];
+		snprintf(keyStr, sizeof keyStr, "%016llx", (unsigned long long)k);
+		fs << "{:";
+		fs << "key"   << std::string(keyStr);
+		fs << "dr"    << e.dr;
+		fs << "score" << e.score;
+		fs << "}";
+	}
+	fs << "]";
+	fs.release();
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "stitchapi.h"
+#include <opencv2/core.hpp>
+#include <stdint.h>
+#include <string>
+#include <mutex>
+#include <unordered_map>
+
+uint64_t hashBytes(const void* data, size_t len, uint64_t seed);
+
+/**
+ * Cache of pairwise overlap results, keyed by the content of both tiles and
+ * every search parameter that affects the result. Because the key does not
+ * depend on the grid layout, a cache can be carried across runs: after a
+ * tile is re-acquired or a parameter changes, only the affected pairs miss.
+ *
+ * lookup and store may be called from multiple threads.
+ */
+class STITCH_API OverlapCache
+{
+public:
+	static uint64_t pairKey(uint64_t hashA, uint64_t hashB, int dir, cv::Point2i guess, cv::Point2i range,
+	                        int logSteps, cv::Size cropSize, int engine);
+
+	bool lookup(uint64_t key, cv::Point2i& dr, float& score);
+	void store(uint64_t key, cv::Point2i dr, float score);
+	void clear();
+	size_t size();
+
+	bool load(std::string path);
+	void save(std::string path);
+private:
+	struct Entry {
+		cv::Point2i dr;
+		float       score;
+	};
+	std::mutex                          lock;
+	std::unordered_map<uint64_t, Entry> entries;
+};
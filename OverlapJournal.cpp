@@ -0,0 +1,132 @@
+#include "pch.h"
+#include "OverlapJournal.h"
+#include "scanset.h"
+#include <string.h>
+
+using namespace cv;
+
+#define JOURNAL_MAGIC "# libmicrostitch overlap journal v2"
+
+OverlapJournal::~OverlapJournal()
+{
+	close();
+}
+
+/**
+ * Opens a journal, reading back any pairs recorded by an earlier run.
+ *
+ * @param path           Journal file, created if it does not exist yet
+ * @param gridWidth      Grid dimensions, a journal for another grid is rejected
+ * @param flushInterval  Number of pairs to buffer before writing them out
+ * @param searchHash     Search parameters of the solver that will use the
+ *                       journal, see PairOverlapSolver::searchHash
+ * @return false if the file could not be opened, or belongs to another grid
+ *         or other search parameters
+ */
+bool OverlapJournal::open(std::string path, int gridWidth, int gridHeight, int flushInterval, uint64_t searchHash)
+{
+	char line[256];
+	int w, h, lastChar = '\n';
+	unsigned long long hash;
+	Record r;
+
+	close();
+	this->gridWidth     = gridWidth;
+	this->gridHeight    = gridHeight;
+	this->flushInterval = flushInterval > 0 ? flushInterval : 1;
+	this->paramsHash    = searchHash;
+	restored.clear();
+	done.clear();
+
+	/* Read back an existing journal */
+	file = fopen(path.c_str(), "rb");
+	if (file) {
+		if (fgets(line, sizeof line, file)) {
+			if (sscanf(line, JOURNAL_MAGIC " %i %i %llx", &w, &h, &hash) != 3 || w != gridWidth || h != gridHeight ||
+			    hash != searchHash) {
+				fclose(file);
+				file = nullptr;
+				return false;
+			}
+			lastChar = line[strlen(line) - 1];
+		}
+		while (fgets(line, sizeof line, file)) {
+			lastChar = line[strlen(line) - 1];
+
+			/* A torn final line from a crash simply fails to parse */
+			if (sscanf(line, "%i %i %i %i %i %f", &r.x, &r.y, &r.dir, &r.dr.x, &r.dr.y, &r.score) != 6)
+				continue;
+			if (r.x < 0 || r.x >= gridWidth || r.y < 0 || r.y >= gridHeight || r.dir < 0 || r.dir > 3)
+				continue;
+			if (done.insert(pairId(r.x, r.y, r.dir)).second)
+				restored.push_back(r);
+		}
+		fclose(file);
+	}
+
+	file = fopen(path.c_str(), "ab");
+	if (!file)
+		return false;
+	fseek(file, 0, SEEK_END);
+	if (ftell(file) == 0)
+		fprintf(file, JOURNAL_MAGIC " %i %i %016llx\n", gridWidth, gridHeight, (unsigned long long)searchHash);
+	else if (lastChar != '\n')
+		fputc('\n', file);
+	fflush(file);
+	return true;
+}
+
+void OverlapJournal::close()
+{
+	flush();
+	std::lock_guard<std::mutex> guard(lock);
+	if (file)
+		fclose(file);
+	file = nullptr;
+}
+
+void OverlapJournal::flush()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	writePending();
+}
+
+void OverlapJournal::writePending()
+{
+	if (!file)
+		return;
+	for (Record& r : pending)
+		fprintf(file, "%i %i %i %i %i %g\n", r.x, r.y, r.dir, r.dr.x, r.dr.y, r.score);
+	fflush(file);
+	pending.clear();
+}
+
+/**
+ * Records a completed pair. Safe to call from multiple threads.
+ */
+void OverlapJournal::record(int x, int y, int dir, cv::Point2i dr, float score)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	pending.push_back(Record{ x, y, dir, dr, score });
+	if ((int) pending.size() >= flushInterval)
+		writePending();
+}
+
+/**
+ * Checks whether a pair was restored from the journal when it was opened.
+ */
+bool OverlapJournal::contains(int x, int y, int dir)
+{
+	return done.count(pairId(x, y, dir)) != 0;
+}
+
+/**
+ * Restores the pairs read back from the journal into the scan set.
+ * @return the number of pairs restored
+ */
+int OverlapJournal::replay(ScanSet& set)
+{
+	for (Record& r : restored)
+		set.setDisplacement(Point2i(r.x, r.y), r.dir, r.dr, r.score);
+	return (int) restored.size();
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "stitchapi.h"
+#include <opencv2/core.hpp>
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <mutex>
+#include <vector>
+#include <unordered_set>
+
+class ScanSet;
+
+/**
+ * Append-only journal of completed overlap pairs, so an interrupted overlap
+ * run can pick up where it left off instead of starting over.
+ *
+ * Results are buffered and written out every flushInterval pairs. On restart
+ * the journal is opened again, replay() restores the finished pairs into the
+ * scan set and the overlap solvers skip them.
+ *
+ * The journal records the search parameters it was written with (see
+ * PairOverlapSolver::searchHash), so results measured with other parameters
+ * are never replayed.
+ */
+class STITCH_API OverlapJournal
+{
+public:
+	~OverlapJournal();
+
+	bool open(std::string path, int gridWidth, int gridHeight, int flushInterval, uint64_t searchHash);
+	void close();
+	void flush();
+
+	void record(int x, int y, int dir, cv::Point2i dr, float score);
+	bool contains(int x, int y, int dir);
+	int  replay(ScanSet& set);
+	uint64_t searchHash() const { return paramsHash; }
+private:
+	struct Record {
+		int         x, y, dir;
+		cv::Point2i dr;
+		float       score;
+	};
+	uint64_t pairId(int x, int y, int dir) const { return ((uint64_t)dir * gridHeight + y) * gridWidth + x; }
+	void     writePending();
+
+	std::mutex                   lock;
+	FILE*                        file = nullptr;
+	int                          gridWidth = 0;
+	int                          gridHeight = 0;
+	int                          flushInterval = 1;
+	uint64_t                     paramsHash = 0;
+	std::vector<Record>          pending;
+	std::vector<Record>          restored;
+	std::unordered_set<uint64_t> done;
+};
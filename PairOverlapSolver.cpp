@@ -0,0 +1,859 @@
+#include "pch.h"
+#include "PairOverlapSolver.h"
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include "stitch.h"
+#include "Trace.h"
+#include <assert.h>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include <atomic>
+#include <chrono>
+
+using namespace cv;
+
+#define BAD_SCORE (1e29)
+#define NAN_SCORE NAN
+static void cropImage(Size cropSize, Mat& in, Mat& out) {
+	Size sourceSz = Size(in.cols, in.rows);
+	Rect cropRect((Point2i(sourceSz) - Point2i(cropSize)) / 2, cropSize);
+	out = in(cropRect);
+}
+
+/**
+ * Measures a pair of tiles.
+ * @param samplesA   Sample cache of A for the sparse engine, see
+ *                   ScanImage::sparse
+ */
+float PairOverlapSolver::findOverlapPair(ScanImage& imageA, ScanImage& imageB, cv::Point2i guess, cv::Point2i range, cv::Point2i& dr,
+                                         SparseSamples* samplesA)
+{
+	Mat im_a, im_b, im_ca, im_cb;
+	OverlapStats stats = {};
+	int64_t t0 = metrics ? Metrics::now() : 0;
+	float score;
+
+	/* Load images */
+	if (!imageA.getImage(im_a)) {
+		fatal("Could not load image for overlap: \"" + imageA.path + "\"");
+		return NAN_SCORE;
+	}
+	if (!imageB.getImage(im_b)) {
+		fatal("Could not load image for overlap: \"" + imageA.path + "\"");
+		return NAN_SCORE;
+	}
+
+	/* Crop images */
+	{
+		TraceSpan span("crop");
+		cropImage(cropSize, im_a, im_ca);
+		cropImage(cropSize, im_b, im_cb);
+	}
+
+	/* Compute score, on more than one thread if the pair loop leaves some idle */
+	score = iterBestOverlapEngine(im_ca, im_cb, guess, range, logSteps, dr, engine, metrics ? &stats : nullptr, &executor(), samplesA);
+
+	if (metrics) {
+		metrics->add(METRIC_PAIRS_MEASURED);
+		for (int l = 0; l < OVERLAP_MAX_LEVELS && l < METRIC_MAX_LEVELS; l++)
+			metrics->add(METRIC_SCORE_EVALS + l, stats.evaluations[l]);
+		metrics->record(HIST_PAIR_US, Metrics::now() - t0);
+	}
+	return score;
+}
+
+float PairOverlapSolver::findOverlapPair(ScanSet& set, int x, int y, int dir, cv::Point2i guess, cv::Point2i& dr)
+{
+	ScanImage& imA = set.imageAt(x, y);
+	ScanImage& imB = set.imageAt(x, y, dir);
+
+	return findOverlapPair(imA, imB, guess, getRange(dir), dr, &imA.sparse[dir]);
+
+}
+
+static const int perpendicularDir[4][2] = {
+	{ DISP_LEFT, DISP_RIGHT }, { DISP_LEFT, DISP_RIGHT }, { DISP_UP, DISP_DOWN }, { DISP_UP, DISP_DOWN }
+};
+
+static int medianOf(std::vector<int>& v)
+{
+	std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+	return v[v.size() / 2];
+}
+
+/**
+ * Predicts the displacement of pair (gA, dir) from pairs around it that were
+ * already measured:
+ *  - the same direction pair of each of the 8 neighbouring tiles, corrected
+ *    for the difference in stage movement between the two pairs
+ *  - the closing side of the two 2x2 loops that contain the pair
+ *
+ * Only tiles within one step of the pair are looked at, the overlap passes
+ * rely on this to measure pairs in parallel (see computeOverlapsY).
+ *
+ * @param guess     Median of the predictions
+ * @param spread    Largest deviation of a prediction from the median
+ * @param refScore  Median score of the neighbouring pairs, NAN if unknown
+ * @return the number of predictions, guess is only set if this is not 0
+ */
+int PairOverlapSolver::predictPair(ScanSet& set, cv::Point2i gA, int dir, cv::Point2i& guess, cv::Point2i& spread, float& refScore)
+{
+	Rect grid(0, 0, set.gridWidth, set.gridHeight);
+	Point2i gB = gA + DISP_DIRECTIONS[dir];
+	Point2i stage = stageGuess(set, gA, gB);
+	std::vector<int> px, py;
+	std::vector<float> scores;
+
+	for (int oy = -1; oy <= 1; oy++) {
+		for (int ox = -1; ox <= 1; ox++) {
+			Point2i gC = gA + Point2i(ox, oy), gD = gC + DISP_DIRECTIONS[dir];
+			if ((ox == 0 && oy == 0) || !grid.contains(gC) || !grid.contains(gD) || !set.hasDisplacement(gC, dir))
+				continue;
+			Point2i p = set.displacementAt(gC, dir) + stage - stageGuess(set, gC, gD);
+			px.push_back(p.x);
+			py.push_back(p.y);
+			if (!std::isnan(set.pairScoreAt(gC, dir)))
+				scores.push_back(set.pairScoreAt(gC, dir));
+		}
+	}
+
+	for (int p : perpendicularDir[dir]) {
+		Point2i gC = gA + DISP_DIRECTIONS[p];
+		if (!grid.contains(gC) || !grid.contains(gB + DISP_DIRECTIONS[p]))
+			continue;
+		if (!set.hasDisplacement(gA, p) || !set.hasDisplacement(gC, dir) || !set.hasDisplacement(gB, p))
+			continue;
+		Point2i c = set.displacementAt(gA, p) + set.displacementAt(gC, dir) - set.displacementAt(gB, p);
+		px.push_back(c.x);
+		py.push_back(c.y);
+	}
+
+	if (px.empty())
+		return 0;
+
+	guess = Point2i(medianOf(px), medianOf(py));
+	spread = Point2i(0, 0);
+	for (size_t i = 0; i < px.size(); i++) {
+		spread.x = std::max(spread.x, std::abs(px[i] - guess.x));
+		spread.y = std::max(spread.y, std::abs(py[i] - guess.y));
+	}
+	if (scores.empty())
+		refScore = NAN;
+	else {
+		std::nth_element(scores.begin(), scores.begin() + scores.size() / 2, scores.end());
+		refScore = scores[scores.size() / 2];
+	}
+	return (int)px.size();
+}
+
+/**
+ * @return the guess for pair (gA, dir) in the GUESS_STAGE, GUESS_RESULT and
+ *         GUESS_FIXED modes
+ */
+cv::Point2i PairOverlapSolver::initialGuess(ScanSet& set, cv::Point2i gA, int dir)
+{
+	Point2i gB = gA + DISP_DIRECTIONS[dir], guess;
+
+	if (guessMode == GUESS_STAGE) {
+		guess = stageGuess(set, gA, gB);
+	}
+	else if (guessMode == GUESS_RESULT) {
+		guess = set.stitchPositionAt(gB) - set.stitchPositionAt(gA);
+	}
+	else if (guessMode == GUESS_FIXED) {
+		guess = (dir == DISP_DOWN || dir == DISP_UP) ? guessV : guessH;
+		if (dir == DISP_UP || dir == DISP_LEFT)
+			guess = -guess;
+	}
+	else
+		assert(!"invalid guess mode");
+	return guess;
+}
+
+float PairOverlapSolver::findOverlapPair(ScanSet& set, int x, int y, int dir, cv::Point2i& dr)
+{
+	float score, refScore = NAN;
+	Point2i guess, spread;
+	Point2i range = getRange(dir);
+	uint64_t key = 0;
+	bool adaptive = false;
+	Point2i gA = Point2i(x, y), gB = gA + DISP_DIRECTIONS[dir];
+	ScanImage& imA = set.imageAt(gA);
+	ScanImage& imB = set.imageAt(gB);
+
+	if (guessMode != GUESS_ADAPTIVE) {
+		guess = initialGuess(set, gA, dir);
+	}
+	else {
+		int n = predictPair(set, gA, dir, guess, spread, refScore);
+		if (n == 0) {
+			/* Nothing measured nearby yet, search the whole range */
+			guess = stageGuess(set, gA, gB);
+		}
+		else {
+			/* A single prediction says nothing about its own accuracy */
+			int minRange = n == 1 ? 2 * adaptiveMinRange : adaptiveMinRange;
+			range.x = std::min(range.x, 2 * spread.x + minRange);
+			range.y = std::min(range.y, 2 * spread.y + minRange);
+			adaptive = true;
+		}
+	}
+
+	/* Reuse an earlier result for the exact same tiles and search */
+	if (cache) {
+		key = OverlapCache::pairKey(imA.contentHash(), imB.contentHash(), dir, guess, range,
+		                            logSteps, cropSize, engine);
+		if (cache->lookup(key, dr, score)) {
+			if (metrics)
+				metrics->add(METRIC_CACHE_HITS);
+			return score;
+		}
+		if (metrics)
+			metrics->add(METRIC_CACHE_MISSES);
+	}
+
+	score = findOverlapPair(imA, imB, guess, range, dr, &imA.sparse[dir]);
+
+	/* A poor match in the narrow window means the prediction was off, retry
+	 * with the full range around the stage guess and keep the better one */
+	if (adaptive && (std::isnan(score) || (!std::isnan(refScore) && score < adaptiveLowScore * refScore))) {
+		Point2i wideDr;
+		Point2i wideGuess = stageGuess(set, gA, gB);
+		float wideScore = findOverlapPair(imA, imB, wideGuess, getRange(dir), wideDr, &imA.sparse[dir]);
+		if (std::isnan(score) || wideScore > score) {
+			score = wideScore;
+			dr    = wideDr;
+			guess = wideGuess;
+		}
+		if (metrics)
+			metrics->add(METRIC_PAIRS_WIDENED);
+	}
+
+	if (cache && !std::isnan(score))
+		cache->store(key, dr, score);
+
+	/* Warn if overly large */
+	if (norm(dr - guess) > maxDistance) {
+		logf(SLOG_WARN,
+			"overly large difference %f from guess encountered at (%3i,%3i)",
+			norm(dr - guess), x, y);
+	}
+
+	return score;
+}
+
+/**
+ * Measures the displacement between tile (x,y) and its dir neighbour and
+ * stores it for both tiles of the pair.
+ */
+float PairOverlapSolver::measurePair(ScanSet& set, int x, int y, int dir)
+{
+	float score;
+	Point2i dr(0, 0);
+	TraceSpan span("pair", x, y, dir);
+
+	score = findOverlapPair(set, x, y, dir, dr);
+	set.setDisplacement(Point2i(x, y), dir, dr, score);
+	if (journal && !std::isnan(score))
+		journal->record(x, y, dir, dr, score);
+	return score;
+}
+
+void PairOverlapSolver::computeOverlapsY(ScanSet& set)
+{
+	computeOverlapsY(set, Rect(0, 0, set.gridWidth, set.gridHeight));
+}
+
+void PairOverlapSolver::computeOverlapsX(ScanSet& set)
+{
+	computeOverlapsX(set, Rect(0, 0, set.gridWidth, set.gridHeight));
+}
+
+/**
+ * Measures the vertical pairs whose top tile lies in block, the bottom tiles
+ * of the last row may lie just below it.
+ */
+void PairOverlapSolver::computeOverlapsY(ScanSet& set, cv::Rect block)
+{
+	int phases = guessMode == GUESS_ADAPTIVE ? 2 : 1;
+	int rows = std::min(block.y + block.height, set.gridHeight - 1) - block.y;
+
+	if (!checkJournal())
+		return;
+	log(SLOG_INFO, "Computing vertical overlaps...");
+	progress(STEP_OVERLAPSY, 0, rows, "Computing overlaps");
+	for (int r = 0; r < rows; r++) {
+		int y = block.y + r;
+		/* Adaptive guesses read the pairs next to them, so those are measured
+		 * in a separate pass over every other column */
+		for (int phase = 0; phase < phases; phase++) {
+			executor().parallelFor(0, (block.width - phase + phases - 1) / phases, [&](int i) {
+				int x = block.x + i * phases + phase;
+				/* Already finished by an earlier, interrupted run */
+				if (cancelled() || (journal && journal->contains(x, y, DISP_DOWN)))
+					return;
+				measurePair(set, x, y, DISP_DOWN);
+			});
+		}
+		progress(STEP_OVERLAPSY, r, rows, "Computing overlaps");
+		if (metrics)
+			metrics->publish();
+		if (cancelled()) {
+			log(SLOG_INFO, "Overlap computation cancelled");
+			break;
+		}
+	}
+	if (journal)
+		journal->flush();
+}
+
+/**
+ * Measures the horizontal pairs whose left tile lies in block (see
+ * computeOverlapsY).
+ */
+void PairOverlapSolver::computeOverlapsX(ScanSet& set, cv::Rect block)
+{
+	int phases = guessMode == GUESS_ADAPTIVE ? 2 : 1;
+	int cols = std::min(block.x + block.width, set.gridWidth - 1) - block.x;
+
+	if (!checkJournal())
+		return;
+	log(SLOG_INFO, "Computing horizontal overlaps...");
+	progress(STEP_OVERLAPSX, 0, cols, "Computing overlaps");
+	for (int c = 0; c < cols; c++) {
+		int x = block.x + c;
+		for (int phase = 0; phase < phases; phase++) {
+			executor().parallelFor(0, (block.height - phase + phases - 1) / phases, [&](int i) {
+				int y = block.y + i * phases + phase;
+				if (cancelled() || (journal && journal->contains(x, y, DISP_RIGHT)))
+					return;
+				measurePair(set, x, y, DISP_RIGHT);
+			});
+		}
+		progress(STEP_OVERLAPSX, c, cols, "Computing overlaps");
+		if (metrics)
+			metrics->publish();
+		if (cancelled()) {
+			log(SLOG_INFO, "Overlap computation cancelled");
+			break;
+		}
+	}
+	if (journal)
+		journal->flush();
+}
+
+/**
+ * Measures the pairs owned by one shard of the grid: the vertical and
+ * horizontal pairs whose top or left tile lies in block (see
+ * ScanSet::shardBlock). Their other tiles make up a one tile halo below and
+ * to the right of block, which is read but not owned.
+ *
+ * Nothing outside block and its halo is read, so shards can be computed by
+ * separate processes from the same project and joined with
+ * ScanSet::mergeOverlapShards. Adaptive guesses only see the pairs measured
+ * by the shard itself, the result for a shard does not depend on the others.
+ */
+void PairOverlapSolver::computeOverlapsShard(ScanSet& set, cv::Rect block)
+{
+	block &= Rect(0, 0, set.gridWidth, set.gridHeight);
+	logf(SLOG_INFO, "Computing overlaps for shard (%i,%i) %ix%i", block.x, block.y, block.width, block.height);
+	computeOverlapsY(set, block);
+	if (!cancelled())
+		computeOverlapsX(set, block);
+}
+
+/**
+ * Picks about samples pairs spread evenly over the grid, alternating between
+ * vertical and horizontal ones. They lie on a lattice at least two tiles
+ * apart, so no two of them share a tile and they can be measured at the same
+ * time.
+ * @return (x, y, dir) of every pair, dir is DISP_DOWN or DISP_RIGHT
+ */
+std::vector<cv::Vec3i> PairOverlapSolver::samplePairs(ScanSet& set, int samples)
+{
+	std::vector<Vec3i> pairs;
+	int W = set.gridWidth, H = set.gridHeight;
+	int nx = std::max(1, std::min((int)lround(sqrt(samples * (double)W / H)), (W - 1) / 2));
+	int ny = std::max(1, std::min((samples + nx - 1) / nx, (H - 1) / 2));
+
+	for (int iy = 0; iy < ny; iy++) {
+		for (int ix = 0; ix < nx; ix++) {
+			int dir = (ix + iy) % 2 ? DISP_RIGHT : DISP_DOWN;
+			if (H < 2)
+				dir = DISP_RIGHT;
+			else if (W < 2)
+				dir = DISP_DOWN;
+			Point2i g((int)((ix + 0.5) * (W - 1) / nx), (int)((iy + 0.5) * (H - 1) / ny));
+			if (!set.hasImageAt(g, dir) || !set.hasTile(g) || !set.hasTile(g + DISP_DIRECTIONS[dir]))
+				continue;
+			pairs.push_back(Vec3i(g.x, g.y, dir));
+		}
+	}
+	return pairs;
+}
+
+/**
+ * Fits the linear part of a stage to image map to the samples in use.
+ * @return false if the samples do not span the plane
+ */
+static bool fitLinear(const std::vector<Point2f>& s, const std::vector<Point2f>& p, const std::vector<int>& use, Matx22d& m)
+{
+	Matx22d ss(0, 0, 0, 0), ps(0, 0, 0, 0);
+
+	for (int i : use) {
+		ss(0, 0) += s[i].x * s[i].x; ss(0, 1) += s[i].x * s[i].y; ss(1, 1) += s[i].y * s[i].y;
+		ps(0, 0) += p[i].x * s[i].x; ps(0, 1) += p[i].x * s[i].y;
+		ps(1, 0) += p[i].y * s[i].x; ps(1, 1) += p[i].y * s[i].y;
+	}
+	ss(1, 0) = ss(0, 1);
+	double det = ss(0, 0) * ss(1, 1) - ss(0, 1) * ss(0, 1);
+	if (fabs(det) < 1e-9 * (ss(0, 0) * ss(1, 1) + 1e-30))
+		return false;
+	m = ps * Matx22d(ss(1, 1) / det, -ss(0, 1) / det, -ss(0, 1) / det, ss(0, 0) / det);
+	return true;
+}
+
+/**
+ * Measures about samples pairs spread over the grid (see samplePairs) in
+ * parallel, with the current guess mode and ranges, and fits the linear map
+ * m from the stage displacement of a pair to its image displacement. The
+ * stage displacement is taken from the grid positions if gridSpace is set,
+ * and from the stage positions otherwise.
+ *
+ * Every two samples determine a candidate map. The one that agrees with the
+ * most samples to within maxError pixels wins, and is refined with a least
+ * squares fit on those. There are few samples, so all candidates are tried
+ * and the result is deterministic.
+ * @return false if no map could be fitted, fit then only counts the samples
+ */
+bool PairOverlapSolver::fitSampledPairs(ScanSet& set, int samples, float maxError, bool gridSpace, MatrixFit& fit, cv::Matx22d& m)
+{
+	std::vector<Vec3i> pairs = samplePairs(set, samples);
+	int n = (int)pairs.size();
+	std::vector<Point2f> s(n), p(n);
+	std::vector<float> scores(n);
+
+	progress(STEP_GRIDVEC, 0, n, "Measuring calibration pairs");
+	executor().parallelFor(0, n, [&](int i) {
+		Point2i g(pairs[i][0], pairs[i][1]), dr;
+		int dir = pairs[i][2];
+		if (gridSpace)
+			s[i] = Point2f(set.gridPositions[set.tileIndex(g + DISP_DIRECTIONS[dir])] - set.gridPositions[set.tileIndex(g)]);
+		else
+			s[i] = set.stagePositionAt(g + DISP_DIRECTIONS[dir]) - set.stagePositionAt(g);
+		scores[i] = cancelled() ? NAN : findOverlapPair(set, g.x, g.y, dir, dr);
+		p[i] = Point2f(dr);
+	});
+
+	std::vector<int> valid;
+	for (int i = 0; i < n; i++)
+		if (!std::isnan(scores[i]) && scores[i] > 0)
+			valid.push_back(i);
+	fit.samples = (int)valid.size();
+
+	/* Consensus over every minimal sample */
+	Matx22d best;
+	std::vector<int> bestInliers;
+	double bestCost = 0;
+	for (size_t a = 0; a < valid.size(); a++) {
+		for (size_t b = a + 1; b < valid.size(); b++) {
+			Matx22d m;
+			std::vector<int> inliers;
+			double cost = 0;
+			if (!fitLinear(s, p, { valid[a], valid[b] }, m))
+				continue;
+			for (int i : valid) {
+				Vec2d r = m * Vec2d(s[i].x, s[i].y) - Vec2d(p[i].x, p[i].y);
+				double e = sqrt(r.dot(r));
+				if (e > maxError)
+					continue;
+				inliers.push_back(i);
+				cost += e;
+			}
+			if (inliers.size() > bestInliers.size() || (inliers.size() == bestInliers.size() && cost < bestCost)) {
+				best = m;
+				bestInliers = inliers;
+				bestCost = cost;
+			}
+		}
+	}
+
+	if (bestInliers.size() < 2 || !fitLinear(s, p, bestInliers, best)) {
+		logf(SLOG_WARN, "Calibration failed, only %i of %i pairs could be measured", fit.samples, n);
+		return false;
+	}
+
+	/* Residuals of the final fit, samples that drifted out are dropped */
+	double sq = 0;
+	for (int i : bestInliers) {
+		Vec2d r = best * Vec2d(s[i].x, s[i].y) - Vec2d(p[i].x, p[i].y);
+		if (sqrt(r.dot(r)) > maxError)
+			continue;
+		fit.spread.x = std::max(fit.spread.x, (float)fabs(r[0]));
+		fit.spread.y = std::max(fit.spread.y, (float)fabs(r[1]));
+		sq += r.dot(r);
+		fit.inliers++;
+	}
+	fit.rms = fit.inliers ? (float)sqrt(sq / fit.inliers) : 0.f;
+	m = best;
+	return true;
+}
+
+
+/**
+ * Measures the displacement between two tiles that are not neighbours in a
+ * grid, such as the same tile in two layers of a stack.
+ */
+float PairOverlapSolver::measureImages(ScanImage& imageA, ScanImage& imageB, cv::Point2i guess, cv::Point2i range, cv::Point2i& dr)
+{
+	return findOverlapPair(imageA, imageB, guess, range, dr);
+}
+
+/**
+ * @return the distance between the measured displacement of pair (g, dir)
+ *         and the one implied by the solved tile positions
+ */
+float PairOverlapSolver::pairResidual(ScanSet& set, cv::Point2i g, int dir)
+{
+	Point2i solved = set.stitchPositionAt(g + DISP_DIRECTIONS[dir]) - set.stitchPositionAt(g);
+	return (float)norm(set.displacementAt(g, dir) - solved);
+}
+
+/**
+ * Finds the measured pairs that disagree with the solved tile positions by
+ * more than maxResidual pixels. Run after a solver has committed its
+ * positions to the set.
+ * @return (x, y, dir) of every outlier, dir is DISP_DOWN or DISP_RIGHT
+ */
+std::vector<cv::Vec3i> PairOverlapSolver::findOutliers(ScanSet& set, float maxResidual)
+{
+	std::vector<Vec3i> outliers;
+
+	for (int y = 0; y < set.gridHeight; y++) {
+		for (int x = 0; x < set.gridWidth; x++) {
+			Point2i g(x, y);
+			if (!set.hasTile(g))
+				continue;
+			for (int d : { DISP_DOWN, DISP_RIGHT }) {
+				if (!set.hasImageAt(g, d) || !set.hasDisplacement(g, d) || !set.hasTile(g + DISP_DIRECTIONS[d]))
+					continue;
+				if (pairResidual(set, g, d) > maxResidual)
+					outliers.push_back(Vec3i(x, y, d));
+			}
+		}
+	}
+	return outliers;
+}
+
+/**
+ * Measures the outliers (see findOutliers) again, searching around the
+ * solved positions with rangeScale times the normal range. A new result is
+ * only kept if it agrees better with the solution than the old one. The
+ * solver has to be run again afterwards to take the new displacements into
+ * account.
+ *
+ * Only the outliers are measured, so this costs a fraction of an overlap
+ * pass proportional to the outlier rate. The new measurements are not
+ * journaled, as the journal only holds results of the overlap pass its
+ * search parameters describe.
+ * @return the number of pairs that were changed
+ */
+int PairOverlapSolver::remeasureOutliers(ScanSet& set, float maxResidual, float rangeScale)
+{
+	std::vector<Vec3i> outliers = findOutliers(set, maxResidual);
+	std::vector<uint8_t> busy(set.gridWidth * set.gridHeight);
+	std::vector<Vec3i> round;
+	std::atomic<int> changed(0);
+	int savedMode = guessMode;
+	Point2i savedH = rangeH, savedV = rangeV;
+	OverlapJournal* savedJournal = journal;
+
+	logf(SLOG_INFO, "Re-measuring %i outlier pairs...", (int)outliers.size());
+	journal   = nullptr;
+	guessMode = GUESS_RESULT;
+	rangeH = Point2i(Point2f(savedH) * rangeScale);
+	rangeV = Point2i(Point2f(savedV) * rangeScale);
+
+	/* Tiles are not safe to load from two threads, so pairs sharing a tile
+	 * go into separate rounds */
+	while (!outliers.empty() && !cancelled()) {
+		std::vector<Vec3i> rest;
+		std::fill(busy.begin(), busy.end(), 0);
+		round.clear();
+		for (const Vec3i& o : outliers) {
+			Point2i gA(o[0], o[1]), gB = gA + DISP_DIRECTIONS[o[2]];
+			uint8_t& a = busy[set.tileIndex(gA)];
+			uint8_t& b = busy[set.tileIndex(gB)];
+			if (a || b) {
+				rest.push_back(o);
+				continue;
+			}
+			a = b = 1;
+			round.push_back(o);
+		}
+		executor().parallelFor(0, (int)round.size(), [&](int i) {
+			Point2i g(round[i][0], round[i][1]);
+			int dir = round[i][2];
+			Point2i oldDr = set.displacementAt(g, dir);
+			float oldScore = set.pairScoreAt(g, dir);
+			float oldResidual = pairResidual(set, g, dir);
+
+			if (cancelled())
+				return;
+			measurePair(set, g.x, g.y, dir);
+			if (metrics)
+				metrics->add(METRIC_PAIRS_REMEASURED);
+			if (pairResidual(set, g, dir) < oldResidual)
+				changed++;
+			else
+				set.setDisplacement(g, dir, oldDr, oldScore);
+		});
+		outliers.swap(rest);
+	}
+
+	guessMode = savedMode;
+	rangeH  = savedH;
+	rangeV  = savedV;
+	journal = savedJournal;
+	logf(SLOG_INFO, "Re-measured outliers, %i pairs changed", changed.load());
+	return changed;
+}
+
+/**
+ * Runs computeOverlapsY in the background. set must not be touched until the
+ * job has finished.
+ */
+SolverJob PairOverlapSolver::computeOverlapsYAsync(ScanSet& set, solve_done_cb_t cb, void* arg)
+{
+	return startJob([this, &set]() { computeOverlapsY(set); }, cb, arg);
+}
+
+/**
+ * Runs computeOverlapsX in the background (see computeOverlapsYAsync).
+ */
+SolverJob PairOverlapSolver::computeOverlapsXAsync(ScanSet& set, solve_done_cb_t cb, void* arg)
+{
+	return startJob([this, &set]() { computeOverlapsX(set); }, cb, arg);
+}
+
+void PairOverlapSolver::setFixedGuess(cv::Point2i guessH, cv::Point2i guessV)
+{
+	this->guessMode = GUESS_FIXED;
+	this->guessH = guessH;
+	this->guessV = guessV;
+}
+
+/**
+ * Hash of every solver parameter that affects the result of a pair: those of
+ * the OverlapCache key that are not specific to the pair, and the ones the
+ * guess and range of a pair are derived from. Journals are opened with it.
+ */
+uint64_t PairOverlapSolver::searchHash() const
+{
+	int32_t params[] = { guessMode, maxDistance, logSteps, cropSize.width, cropSize.height, rangeH.x, rangeH.y,
+	                     rangeV.x, rangeV.y, guessH.x, guessH.y, guessV.x, guessV.y, engine,
+	                     adaptiveMinRange, (int32_t)lround(adaptiveLowScore * 1e6) };
+	return hashBytes(params, sizeof params, 0);
+}
+
+/**
+ * Refuses a journal written with other search parameters, pairs it skips
+ * would otherwise keep results measured differently.
+ */
+bool PairOverlapSolver::checkJournal()
+{
+	if (!journal || journal->searchHash() == searchHash())
+		return true;
+	fatal("The overlap journal was opened for other search parameters");
+	return false;
+}
+
+/**
+ * Tunes GUESS_ADAPTIVE.
+ * @param minRange       Smallest search range used around a prediction
+ * @param lowScoreRatio  A match scoring below this fraction of its neighbours
+ *                       is searched again with the full range
+ */
+void PairOverlapSolver::setAdaptive(int minRange, float lowScoreRatio)
+{
+	this->adaptiveMinRange = minRange;
+	this->adaptiveLowScore = lowScoreRatio;
+}
+
+void PairOverlapSolver::setParameters(int guessMode, int maxDist, int logSteps, cv::Size cropSize, cv::Point2i rangeH, cv::Point2i rangeV)
+{
+	this->guessMode = guessMode;
+	this->maxDistance = maxDist;
+	this->logSteps = logSteps;
+	this->cropSize = cropSize;
+	this->rangeH = rangeH;
+	this->rangeV = rangeV;
+}
+
+void PairOverlapSolver::setParameters(const OverlapParams& params)
+{
+	setParameters(params.guessMode, params.maxDistance, params.logSteps, params.cropSize, params.rangeH, params.rangeV);
+	engine = params.engine;
+}
+
+OverlapParams PairOverlapSolver::getParameters() const
+{
+	OverlapParams params;
+	params.guessMode   = guessMode;
+	params.maxDistance = maxDistance;
+	params.logSteps    = logSteps;
+	params.cropSize    = cropSize;
+	params.rangeH      = rangeH;
+	params.rangeV      = rangeV;
+	params.engine      = engine;
+	return params;
+}
+
+/**
+ * Rough number of pixel comparisons iterBestOverlapNC does for one pair, used
+ * to try the cheap candidates first.
+ */
+static double searchCost(const OverlapParams& p)
+{
+	Point2i r = p.rangeH.x * p.rangeH.y > p.rangeV.x * p.rangeV.y ? p.rangeH : p.rangeV;
+	double cost = 0;
+
+	for (int l = p.logSteps; l >= 0; l--) {
+		double d = 1 << l;
+		cost += (2 * r.x / d + 1) * (2 * r.y / d + 1) * p.cropSize.area() / (d * d);
+		r = r / 4 + Point2i(1, 1);
+	}
+	return cost;
+}
+
+/**
+ * Looks for the cheapest search parameters that still give the same
+ * displacements as the current ones, which should be set to conservative
+ * values first.
+ *
+ * The current parameters measure about samples pairs (see samplePairs) as
+ * the reference. Candidates with other pyramid depths, smaller crops and
+ * ranges sized from the deviations from the guess seen in the reference are
+ * then tried on the same pairs, cheapest first by estimate, until
+ * budgetSeconds have passed. The first one that reproduces the reference to
+ * within tolerance pixels on all but one in twenty pairs, and is measured to
+ * be faster than it, is returned. maxDistance is set to twice the largest
+ * deviation seen.
+ *
+ * Tiles are decoded by the reference run and kept, so only the search itself
+ * is timed. The solver's parameters are left unchanged, pass the result to
+ * setParameters to use it.
+ */
+OverlapParams PairOverlapSolver::autoTune(ScanSet& set, int samples, double budgetSeconds, float tolerance)
+{
+	typedef std::chrono::steady_clock clock;
+	clock::time_point start = clock::now();
+	OverlapParams saved = getParameters(), base = saved, best;
+	OverlapCache* savedCache = cache;
+	OverlapJournal* savedJournal = journal;
+	Metrics* savedMetrics = metrics;
+	std::vector<Vec3i> pairs = samplePairs(set, samples);
+	int n = (int)pairs.size();
+	std::vector<Point2i> ref(n), dr(n), guesses(n);
+	std::vector<float> scores(n);
+
+	/* Every candidate has to do the work itself */
+	cache   = nullptr;
+	journal = nullptr;
+	metrics = nullptr;
+	/* The adaptive guess learns from earlier pairs, so it is measured as
+	 * the stage guess it falls back to */
+	if (base.guessMode == GUESS_ADAPTIVE)
+		base.guessMode = GUESS_STAGE;
+	best = base;
+
+	auto measure = [&](const OverlapParams& p) {
+		setParameters(p);
+		clock::time_point t0 = clock::now();
+		executor().parallelFor(0, n, [&](int i) {
+			scores[i] = cancelled() ? NAN : findOverlapPair(set, pairs[i][0], pairs[i][1], pairs[i][2], dr[i]);
+		});
+		return std::chrono::duration<double>(clock::now() - t0).count();
+	};
+
+	logf(SLOG_INFO, "Auto-tuning on %i pairs...", n);
+	double bestTime = measure(base);
+	std::vector<bool> valid(n);
+	Point2i dev(0, 0);
+	int nValid = 0;
+	for (int i = 0; i < n; i++) {
+		Point2i gA(pairs[i][0], pairs[i][1]);
+		valid[i] = !std::isnan(scores[i]) && scores[i] > 0;
+		ref[i] = dr[i];
+		if (!valid[i])
+			continue;
+		nValid++;
+		Point2i d = dr[i] - initialGuess(set, gA, pairs[i][2]);
+		dev.x = std::max(dev.x, std::abs(d.x));
+		dev.y = std::max(dev.y, std::abs(d.y));
+	}
+	if (nValid < 2) {
+		log(SLOG_WARN, "Auto-tune: too few pairs could be measured, keeping the parameters");
+		setParameters(saved);
+		cache = savedCache; journal = savedJournal; metrics = savedMetrics;
+		return saved;
+	}
+
+	/* Candidates: the current range and ones fitted to the deviations seen,
+	 * for each of a few crops and pyramid depths */
+	std::vector<OverlapParams> candidates;
+	Point2i tight(std::max(4, 2 * dev.x + 2), std::max(4, 2 * dev.y + 2));
+	Point2i ranges[3][2] = {
+		{ base.rangeH, base.rangeV },
+		{ Point2i(std::min(base.rangeH.x, 2 * tight.x), std::min(base.rangeH.y, 2 * tight.y)),
+		  Point2i(std::min(base.rangeV.x, 2 * tight.x), std::min(base.rangeV.y, 2 * tight.y)) },
+		{ Point2i(std::min(base.rangeH.x, tight.x), std::min(base.rangeH.y, tight.y)),
+		  Point2i(std::min(base.rangeV.x, tight.x), std::min(base.rangeV.y, tight.y)) },
+	};
+	double crops[3] = { 1.0, 0.875, 0.75 };
+	for (int l = 0; l <= std::max(base.logSteps + 2, 4); l++) {
+		for (double c : crops) {
+			for (auto& r : ranges) {
+				OverlapParams p = base;
+				p.logSteps = l;
+				p.cropSize = Size((int)(base.cropSize.width * c), (int)(base.cropSize.height * c));
+				p.rangeH = r[0];
+				p.rangeV = r[1];
+				candidates.push_back(p);
+			}
+		}
+	}
+	std::stable_sort(candidates.begin(), candidates.end(), [](const OverlapParams& a, const OverlapParams& b) {
+		return searchCost(a) < searchCost(b);
+	});
+
+	int tried = 0;
+	for (const OverlapParams& p : candidates) {
+		if (std::chrono::duration<double>(clock::now() - start).count() > budgetSeconds || cancelled())
+			break;
+		if (searchCost(p) >= searchCost(best))
+			continue;
+		double t = measure(p);
+		int bad = 0;
+		tried++;
+		for (int i = 0; i < n; i++)
+			if (valid[i] && (std::isnan(scores[i]) || norm(dr[i] - ref[i]) > tolerance))
+				bad++;
+		if (bad * 20 > nValid || t >= bestTime)
+			continue;
+		best = p;
+		bestTime = t;
+	}
+
+	best.maxDistance = (int)ceil(2 * norm(dev)) + 1;
+	best.guessMode = saved.guessMode;
+	setParameters(saved);
+	cache   = savedCache;
+	journal = savedJournal;
+	metrics = savedMetrics;
+	logf(SLOG_INFO, "Auto-tune: tried %i candidates, logSteps %i, crop %ix%i, range (%i,%i)/(%i,%i), %.1f ms per pair",
+	     tried, best.logSteps, best.cropSize.width, best.cropSize.height,
+	     best.rangeH.x, best.rangeH.y, best.rangeV.x, best.rangeV.y, 1e3 * bestTime / n);
+	return best;
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "stitchapi.h"
+#include "Solver.h"
+#include "scanset.h"
+#include "OverlapCache.h"
+#include "OverlapJournal.h"
+#include "stitch.h"
+
+#define GUESS_STAGE  (0)
+#define GUESS_RESULT (1)
+#define GUESS_FIXED (2)
+#define GUESS_ADAPTIVE (3)   /* Predict from measured neighbour pairs, see setAdaptive */
+
+#define STEP_OVERLAPSY (1)
+#define STEP_OVERLAPSX (2)
+#define STEP_GRIDVEC   (3)
+
+/**
+ * Search parameters of a PairOverlapSolver, see setParameters
+ */
+struct OverlapParams
+{
+	int         guessMode = GUESS_STAGE;
+	int         maxDistance = -1;
+	int         logSteps = -1;
+	cv::Size    cropSize;
+	cv::Point2i rangeH;
+	cv::Point2i rangeV;
+	int         engine = OVERLAP_ENGINE_SSD;
+};
+
+/**
+ * Outcome of a calibration from sampled pairs, see
+ * AffineOverlapSolver::computeMatrixSampled and
+ * OverlapSolver::computeGridVectorSampled
+ */
+struct MatrixFit
+{
+	int         samples = 0;   /* Pairs measured successfully */
+	int         inliers = 0;   /* Pairs the matrix was fitted to */
+	cv::Point2f spread;        /* Largest inlier residual per axis, in pixels */
+	float       rms = 0;       /* RMS inlier residual, in pixels */
+};
+
+/**
+ * Common base for the solvers that measure the displacement between pairs of
+ * neighbouring tiles. Subclasses provide the stage to image mapping used for
+ * the initial guess.
+ */
+class STITCH_API PairOverlapSolver : public Solver
+{
+public:
+	void computeOverlapsX(ScanSet& set);
+	void computeOverlapsY(ScanSet& set);
+	void computeOverlapsX(ScanSet& set, cv::Rect block);
+	void computeOverlapsY(ScanSet& set, cv::Rect block);
+	void computeOverlapsShard(ScanSet& set, cv::Rect block);
+	SolverJob computeOverlapsXAsync(ScanSet& set, solve_done_cb_t cb = nullptr, void* arg = nullptr);
+	SolverJob computeOverlapsYAsync(ScanSet& set, solve_done_cb_t cb = nullptr, void* arg = nullptr);
+	float measurePair(ScanSet& set, int x, int y, int dir);
+	float measureImages(ScanImage& imageA, ScanImage& imageB, cv::Point2i guess, cv::Point2i range, cv::Point2i& dr);
+	float pairResidual(ScanSet& set, cv::Point2i g, int dir);
+	std::vector<cv::Vec3i> findOutliers(ScanSet& set, float maxResidual);
+	int remeasureOutliers(ScanSet& set, float maxResidual, float rangeScale = 2.f);
+	void setFixedGuess(cv::Point2i guessH, cv::Point2i guessV);
+	void setParameters(int guessMode, int maxDist, int logSteps, cv::Size cropSize, cv::Point2i rangeH, cv::Point2i rangeV);
+	void setParameters(const OverlapParams& params);
+	OverlapParams getParameters() const;
+	uint64_t searchHash() const;
+	OverlapParams autoTune(ScanSet& set, int samples, double budgetSeconds, float tolerance = 1.f);
+	void setAdaptive(int minRange, float lowScoreRatio);
+	void setGuessMode(int guessMode) { this->guessMode = guessMode; }
+	/** Selects how pairs are scored, one of the OVERLAP_ENGINE_ values */
+	void setEngine(int engine) { this->engine = engine; }
+	void setRange(cv::Point2i rangeH, cv::Point2i rangeV) { this->rangeH = rangeH; this->rangeV = rangeV; }
+	void setCache(OverlapCache* cache) { this->cache = cache; }
+	void setJournal(OverlapJournal* journal) { this->journal = journal; }
+
+	virtual void applyInitialGrid(ScanSet& set) = 0;
+	virtual cv::Point2i initialPosition(ScanSet& set, cv::Point2i g) = 0;
+protected:
+	virtual cv::Point2i stageGuess(ScanSet& set, cv::Point2i gA, cv::Point2i gB) = 0;
+
+	float findOverlapPair(ScanImage& imageA, ScanImage& imageB, cv::Point2i guess, cv::Point2i range, cv::Point2i& dr,
+	                      SparseSamples* samplesA = nullptr);
+	float findOverlapPair(ScanSet& set, int x, int y, int dir, cv::Point2i guess, cv::Point2i& dr);
+	float findOverlapPair(ScanSet& set, int x, int y, int dir, cv::Point2i& dr);
+	cv::Point2i initialGuess(ScanSet& set, cv::Point2i gA, int dir);
+	std::vector<cv::Vec3i> samplePairs(ScanSet& set, int samples);
+	bool fitSampledPairs(ScanSet& set, int samples, float maxError, bool gridSpace, MatrixFit& fit, cv::Matx22d& m);
+	int predictPair(ScanSet& set, cv::Point2i gA, int dir, cv::Point2i& guess, cv::Point2i& spread, float& refScore);
+	bool checkJournal();
+
+	cv::Point2i getRange(int dir) const {
+		return (dir == DISP_DOWN || dir == DISP_UP) ? rangeV : rangeH;
+	}
+	int         maxDistance = -1;
+	int         guessMode = -1;
+	int         logSteps = -1;
+	cv::Size    cropSize;
+	cv::Point2i rangeV;
+	cv::Point2i rangeH;
+	cv::Point2i guessV;
+	cv::Point2i guessH;
+	int         engine = OVERLAP_ENGINE_SSD;
+	int         adaptiveMinRange = 6;
+	float       adaptiveLowScore = 0.5f;
+	OverlapCache* cache = nullptr;
+	OverlapJournal* journal = nullptr;
+};
@@ -1,5 +1,9 @@
 #include "pch.h"
 #include "RelaxationSolver.h"
+#include "Trace.h"
+#include <assert.h>
+#include <limits.h>
+#include <vector>
 
 using namespace cv;
 
@@ -11,16 +15,18 @@ void RelaxationSolver::setup(ScanSet& set, int maxSanityDiff)
 	sanityNorm = 0;
 	log(SLOG_INFO, "Relaxation: Initializing solver...");
 	posGrid.create(set.gridHeight, set.gridWidth, CV_64FC2);
-	for (int x = 0; x < set.gridWidth; x++)
-		for (int y = 0; y < set.gridHeight; y++) {
-			Point2i pos(x,y);
-			this->posGrid.at<Point2d>(pos) = set.imageAt(pos).stitchPosition;
-		}
-	for (int x = 1; x < set.gridWidth - 1; x++) {
+
+	/* posGrid has the same row-major layout as the tile arrays */
+	Point2d* pos = posGrid.ptr<Point2d>();
+	const Point2i* stitchPos = set.stitchPositions.data();
+	for (int i = 0; i < set.gridWidth * set.gridHeight; i++)
+		pos[i] = stitchPos[i];
+
+	for (int d = 0; d < 4; d++) {
+		const Point2i* disp = set.displacements[d].data();
 		for (int y = 1; y < set.gridHeight - 1; y++) {
-			ScanImage& i = set.imageAt(x, y);
-			for (int d = 0; d < 4; d++)
-				sanityNorm += norm(i.displacements[d]) / 4;
+			for (int x = 1; x < set.gridWidth - 1; x++)
+				sanityNorm += norm(disp[y * set.gridWidth + x]) / 4;
 		}
 	}
 	sanityNorm /= (set.gridWidth - 2) * (set.gridHeight - 2);
@@ -29,20 +35,28 @@ void RelaxationSolver::setup(ScanSet& set, int maxSanityDiff)
 void RelaxationSolver::run(int iters)
 {
 	assert(set != nullptr);
-	int n;
 	double mt;
 	Mat nextPos;
+	std::vector<double> rowMoved(set->gridHeight);
 
 	log(SLOG_INFO, "Relaxation: Starting run of "+std::to_string(iters)+" iterations...");
 	this->posGrid.copyTo(nextPos);
 	for (int it = 0; it < iters; it++, iterations++) {
-		mt = 0;
-		for (int x = 0; x < set->gridWidth; x++) {
-			for (int y = 0; y < set->gridHeight; y++) {
+		TraceSpan span("relax_iteration", -1, -1, iterations);
+
+		/* Every row only reads posGrid and writes its own row of nextPos */
+		executor().parallelFor(0, set->gridHeight, [&](int y) {
+			int n;
+			rowMoved[y] = 0;
+			for (int x = 0; x < set->gridWidth; x++) {
 				Point2i gridPos(x, y);
 				Point2d acc(0, 0);
 				n = 0;
 
+				/* Tiles that have not been acquired yet (live mode) stay put */
+				if (!set->hasTile(gridPos))
+					continue;
+
 				/* Compute average of positions set by neigbors*/
 				for (int d = 0; d < 4; d++)
 					accumulateFromNeighbor(gridPos, d, acc, n);
@@ -56,43 +70,136 @@ void RelaxationSolver::run(int iters)
 				acc /= n;
 
 				/* Keep track of distance moved */
-				mt += norm(this->posGrid.at<Point2d>(gridPos) - acc);
+				rowMoved[y] += norm(this->posGrid.at<Point2d>(gridPos) - acc);
 
 				nextPos.at<Point2d>(gridPos) = acc;
 			}
-		}
+		});
+		mt = 0;
+		for (double m : rowMoved)
+			mt += m;
 		nextPos.copyTo(this->posGrid);
 		progress(0, it, iters, "Solving grid (current score="+std::to_string(mt)+")");
+		if (metrics) {
+			metrics->add(METRIC_RELAX_ITERATIONS);
+			metrics->set(GAUGE_RELAX_RESIDUAL, mt);
+			metrics->publish();
+		}
+		if (cancelled()) {
+			log(SLOG_INFO, "Relaxation: Cancelled, scan set left unchanged.");
+			return;
+		}
 	}
 	log(SLOG_INFO, "Relaxation: Committing results...");
 	/* Commit solution to scan set */
-	for (int x = 0; x < set->gridWidth; x++)
-		for (int y = 0; y < set->gridHeight; y++) {
-			set->imageAt(x, y).stitchPosition = this->posGrid.at<Point2d>(y, x);
+	const Point2d* pos = posGrid.ptr<Point2d>();
+	Point2i* stitchPos = set->stitchPositions.data();
+	for (int i = 0; i < set->gridWidth * set->gridHeight; i++)
+		stitchPos[i] = pos[i];
+
+	updateStitchRect();
+
+	log(SLOG_INFO, "Relaxation done.");
+}
+
+/**
+ * Runs the relaxation in the background. The scan set given to setup must not
+ * be touched until the job has finished.
+ */
+SolverJob RelaxationSolver::runAsync(int iters, solve_done_cb_t cb, void* arg)
+{
+	return startJob([this, iters]() { run(iters); }, cb, arg);
+}
+
+/**
+ * Prepares the solver for live acquisition, where tiles are relaxed locally
+ * as they arrive using runLocal. The positions already stored in the set are
+ * used as the starting point.
+ */
+void RelaxationSolver::setupLive(ScanSet& set, int maxSanityDiff)
+{
+	this->set = &set;
+	this->iterations = 0;
+	this->maxSanityDiff = maxSanityDiff;
+	sanityNorm = 0;
+	posGrid.create(set.gridHeight, set.gridWidth, CV_64FC2);
+
+	Point2d* pos = posGrid.ptr<Point2d>();
+	const Point2i* stitchPos = set.stitchPositions.data();
+	for (int i = 0; i < set.gridWidth * set.gridHeight; i++)
+		pos[i] = stitchPos[i];
+}
+
+/**
+ * Overrides the starting position of a single tile, used to warm start a
+ * newly acquired tile from its neighbours.
+ */
+void RelaxationSolver::setPosition(cv::Point2i pos, cv::Point2d p)
+{
+	posGrid.at<Point2d>(pos) = p;
+}
+
+/**
+ * Relaxes only the tiles inside region, keeping everything outside it fixed.
+ * Updates are done in place so a few iterations are enough when the region
+ * was already close to its solution.
+ */
+void RelaxationSolver::runLocal(cv::Rect region, int iters)
+{
+	assert(set != nullptr);
+	int n;
+
+	region &= Rect(0, 0, set->gridWidth, set->gridHeight);
+	for (int it = 0; it < iters; it++, iterations++) {
+		for (int y = region.y; y < region.y + region.height; y++) {
+			for (int x = region.x; x < region.x + region.width; x++) {
+				Point2i gridPos(x, y);
+				Point2d acc(0, 0);
+				n = 0;
+
+				if (!set->hasTile(gridPos))
+					continue;
+
+				for (int d = 0; d < 4; d++)
+					accumulateFromNeighbor(gridPos, d, acc, n);
+
+				if (n == 0)
+					continue;
+
+				posGrid.at<Point2d>(gridPos) = acc / n;
+			}
 		}
+	}
 
-	/* Find scan set size*/
-	Point2i min_xy, max_xy;
-	double mm, mM;
-	Mat grid[2];
-	split(posGrid, grid);
-	minMaxLoc(grid[0], &mm, &mM); min_xy.x = mm; max_xy.x = mM;
-	minMaxLoc(grid[1], &mm, &mM); min_xy.y = mm; max_xy.y = mM;
-	set->stitchRect = Rect(min_xy, max_xy);
+	/* Commit the region to the scan set */
+	for (int y = region.y; y < region.y + region.height; y++)
+		for (int x = region.x; x < region.x + region.width; x++)
+			set->stitchPositionAt(x, y) = posGrid.at<Point2d>(y, x);
+}
 
+void RelaxationSolver::updateStitchRect()
+{
+	Point2i min_xy(INT_MAX, INT_MAX), max_xy(INT_MIN, INT_MIN);
+	const Point2i* stitchPos = set->stitchPositions.data();
 
-	log(SLOG_INFO, "Relaxation done.");
+	/* Find scan set size*/
+	for (int i = 0; i < set->gridWidth * set->gridHeight; i++) {
+		if (!(set->tileFlags[i] & TILE_PRESENT))
+			continue;
+		min_xy.x = MIN(min_xy.x, stitchPos[i].x); max_xy.x = MAX(max_xy.x, stitchPos[i].x);
+		min_xy.y = MIN(min_xy.y, stitchPos[i].y); max_xy.y = MAX(max_xy.y, stitchPos[i].y);
+	}
+	set->stitchRect = Rect(min_xy, max_xy);
 }
 
 void RelaxationSolver::accumulateFromNeighbor(cv::Point2i pos, int dir, cv::Point2d& acc, int& n)
 {
 	Point2i ds;
-	ScanImage& img = set->imageAt(pos);
 
-	if (!set->hasImageAt(pos, dir))
+	if (!set->hasImageAt(pos, dir) || !set->hasDisplacement(pos, dir))
 		return;
 
-	ds = img.displacements[dir];
+	ds = set->displacementAt(pos, dir);
 	if (cv_abs(norm(ds) - sanityNorm) > maxSanityDiff) {
 		return;
 	}
@@ -1,14 +1,21 @@
 #pragma once
 
-#include "solver.h"
+#include "stitchapi.h"
+#include "Solver.h"
 #include "scanset.h"
 
-class __declspec(dllexport) RelaxationSolver : public Solver
+class STITCH_API RelaxationSolver : public Solver
 {
 public:
 
 	void setup(ScanSet& set, int maxSanityDiff);
 	void run(int iters);
+	SolverJob runAsync(int iters, solve_done_cb_t cb = nullptr, void* arg = nullptr);
+
+	void setupLive(ScanSet& set, int maxSanityDiff);
+	void setSanityNorm(int norm) { sanityNorm = norm; }
+	void setPosition(cv::Point2i pos, cv::Point2d p);
+	void runLocal(cv::Rect region, int iters);
 
 private:
 	cv::Mat                posGrid;
@@ -17,6 +24,7 @@ private:
 	int maxSanityDiff = -1;
 	int iterations = 0;
 	void accumulateFromNeighbor(cv::Point2i pos, int dir, cv::Point2d& acc, int& n);
+	void updateStitchRect();
 
 };
 
@@ -0,0 +1,8 @@
+#include "pch.h"
+#include "ScratchArena.h"
+
+ScratchArena& ScratchArena::local()
+{
+	static thread_local ScratchArena arena;
+	return arena;
+}
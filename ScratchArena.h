@@ -0,0 +1,57 @@
+#pragma once
+
+#include "stitchapi.h"
+#include "stitch.h"
+#include <opencv2/core.hpp>
+
+/* Slots of the scratch arena */
+#define SCRATCH_SEARCH   (0)                                        /* Two per pyramid level, see findBestOverlap */
+#define SCRATCH_GRADIENT (SCRATCH_SEARCH + 2 * OVERLAP_MAX_LEVELS)    /* Two per level, see findBestEdgeOverlap */
+#define SCRATCH_EDGES    (SCRATCH_GRADIENT + 2 * OVERLAP_MAX_LEVELS)  /* Two per level */
+#define SCRATCH_SAMPLES  (SCRATCH_EDGES + 2 * OVERLAP_MAX_LEVELS)     /* Two per level, see findBestSparseOverlap */
+#define SCRATCH_SLOTS    (SCRATCH_SAMPLES + 2 * OVERLAP_MAX_LEVELS)
+
+/**
+ * Per thread buffers for the temporaries of the hot loops. Each slot holds
+ * a Mat that is created into over and over; as long as the tile size stays
+ * the same, which it does within a scan, Mat::create keeps the buffer and
+ * steady state processing does not touch the heap.
+ *
+ * Slots are taken through ScratchMat.
+ */
+class STITCH_API ScratchArena
+{
+public:
+	/** The arena of the calling thread */
+	static ScratchArena& local();
+private:
+	friend class ScratchMat;
+
+	cv::Mat slots[SCRATCH_SLOTS];
+	bool    busy[SCRATCH_SLOTS] = {};
+};
+
+/**
+ * Holds a slot of the calling thread's arena for as long as it lives. If the
+ * slot is already held further up the stack, which an executor running other
+ * work while waiting can cause, a private Mat is used instead.
+ */
+class ScratchMat
+{
+public:
+	explicit ScratchMat(int slot) : arena(ScratchArena::local()), slot(slot) {
+		if (arena.busy[slot])
+			this->slot = -1;
+		else
+			arena.busy[slot] = true;
+	}
+	~ScratchMat() { if (slot >= 0) arena.busy[slot] = false; }
+	ScratchMat(const ScratchMat&) = delete;
+	ScratchMat& operator=(const ScratchMat&) = delete;
+
+	cv::Mat& mat() { return slot >= 0 ? arena.slots[slot] : own; }
+private:
+	ScratchArena& arena;
+	int           slot;
+	cv::Mat       own;
+};
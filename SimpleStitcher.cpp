@@ -1,51 +1,99 @@
 #include "pch.h"
 #include "SimpleStitcher.h"
+#include "Trace.h"
 #include <opencv2/imgproc.hpp>
 #include <opencv2/imgcodecs.hpp>
+#include <vector>
 using namespace cv;
 
 void SimpleStitcher::run(ScanSet& set, std::string path, cv::Size cropSize, int decimate)
 {
-	Point2i src_sz(640, 512);//920, 1080);
-	Rect    crop_rect((src_sz - Point2i(cropSize)) / 2, cropSize);
 	Point2i out_sz = (set.stitchRect.br() + Point2i(cropSize)+Point2i(1,1)+ - set.stitchRect.tl()) / decimate;
+	Point2i origin = set.stitchRect.tl();
+	if (region.area() > 0) {
+		origin += region.tl();
+		out_sz  = Point2i(region.size()) / decimate;
+	}
+	Rect out_rect(0, 0, out_sz.x, out_sz.y);
 	log(SLOG_INFO, "Stitcher: Assembling "+ std::to_string(out_sz.x)+
 		" x " + std::to_string(out_sz.y) + " stitched image ("+std::to_string(decimate)+" times reduced resolution)");
+	/* Colour tiles are composited with all their channels in one pass */
+	int channels = 1;
+	for (int i = 0; i < (int)set.m_Images.size(); i++) {
+		Mat first;
+		if ((set.tileFlags[i] & TILE_PRESENT) && set.m_Images[i].getColorImage(first)) {
+			channels = first.channels();
+			break;
+		}
+	}
 	log(SLOG_INFO, "Stitcher: Allocating output image...");
-	Mat out_img(out_sz.y , out_sz.x , CV_32S);
+	Mat out_img(out_sz.y , out_sz.x , CV_32SC(channels));
 	Mat out_n(out_sz.y , out_sz.x , CV_8S);
 	int total = set.gridWidth * set.gridHeight;
+	int64_t t_start = metrics ? Metrics::now() : 0;
 	log(SLOG_INFO, "Stitcher: Stitching "+std::to_string(total)+" tiles...");
 	out_img = Scalar(0, 0, 0);
 	out_n = Scalar(0);
 
-	for (int x = 0; x < set.gridWidth; x++)
+	/* Scaled tiles of one column. The buffers are reused for every column, all
+	 * tiles have the same size after cropping */
+	std::vector<Mat> column(set.gridHeight);
+	std::vector<char> visible(set.gridHeight);
+
+	for (int x = 0; x < set.gridWidth; x++) {
+		/* Decode and scale a column of tiles in parallel. The tiles overlap in
+		 * the output so they are added to it one by one afterwards */
+		executor().parallelFor(0, set.gridHeight, [&](int y) {
+			if (cancelled())
+				return;
+			int64_t t_tile = metrics ? Metrics::now() : 0;
+			TraceSpan span("stitch_tile", x, y);
+			ScanImage& i = set.imageAt(x, y);
+			Mat srci;
+			visible[y] = (Rect(set.stitchPositionAt(x, y) - origin, cropSize) & Rect(0, 0, out_sz.x * decimate, out_sz.y * decimate)).area() > 0;
+			if (!visible[y])
+				return;
+			i.getColorImage(srci);
+			Rect crop_rect((Point2i(srci.size()) - Point2i(cropSize)) / 2, cropSize);
+			cv::resize(srci(crop_rect), column[y], Size(), 1. / decimate, 1. / decimate);
+			if (!keepTiles)
+				i.evictImage();
+			if (metrics)
+				metrics->record(HIST_STITCH_TILE_US, Metrics::now() - t_tile);
+		});
+
+		if (cancelled()) {
+			log(SLOG_INFO, "Stitcher: Cancelled, no output written.");
+			return;
+		}
 		for (int y = 0; y < set.gridHeight; y++) {
 			progress(1, x * set.gridHeight + y, total, "Stitching tile "+std::to_string(x)+ ","+std::to_string(y));
-			ScanImage& i = set.imageAt(x, y);
-			Point2i im_p = i.stitchPosition - set.stitchRect.tl();
-			Point2i im_pd = im_p / decimate;
-			Range y_rd(MAX(0, im_pd.y), MAX(0, im_pd.y) + cropSize.height / decimate);
-			Range x_rd(MAX(0, im_pd.x), MAX(0, im_pd.x) + cropSize.width / decimate);
-			Mat srci, srcid;
-			i.getImage(srci);
-			cv::resize(srci(crop_rect), srcid, Size(), 1. / decimate, 1. / decimate);
-			Mat f32;
-			out_img(y_rd, x_rd) += srcid;
-			out_n(y_rd, x_rd) += 1;
-			i.evictImage();
+			if (!visible[y])
+				continue;
+			Point2i im_pd = (set.stitchPositionAt(x, y) - origin) / decimate;
+			/* Tiles on the edge of a region are clipped */
+			Rect dst = Rect(im_pd, column[y].size()) & out_rect;
+			if (dst.area() == 0)
+				continue;
+			out_img(dst) += column[y](Rect(dst.tl() - im_pd, dst.size()));
+			out_n(dst) += 1;
+			if (metrics) {
+				metrics->add(METRIC_STITCH_TILES);
+				metrics->add(METRIC_STITCH_PIXELS, (uint64_t)cropSize.area());
+				metrics->publish();
+			}
 		}
+	}
 	log(SLOG_INFO, "Stitcher: completed combining tiles.");
 	log(SLOG_INFO, "Stitcher: Masking zeros to prevent divide error...");
 	Mat zeromask = out_n < 0.0000001;
 	out_n.setTo(0.000001, zeromask);
-	/*Mat out_nn[3], out_n3;
-	out_nn[0] = out_n;
-	out_nn[1] = out_n;
-	out_nn[2] = out_n;
-	merge(out_nn, 3, out_n3);*/
+	if (channels > 1) {
+		std::vector<Mat> out_nn(channels, out_n);
+		merge(out_nn, out_n);
+	}
 	log(SLOG_INFO, "Stitcher: Computing average of overlapped areas...");
-	out_img /= out_n;//3;
+	out_img /= out_n;
 	log(SLOG_INFO, "Stitcher: Filling background pixels...");
 	out_img.setTo(0, zeromask);
 	zeromask.release();
@@ -53,12 +101,26 @@ void SimpleStitcher::run(ScanSet& set, std::string path, cv::Size cropSize, int
 	//patchNaNs(out_img, 0.0);
 	Mat out_cvt;
 	progress(1, 3, 5, "Converting image");
-	log(SLOG_INFO, "Stitcher: Converting image to 24bpp RGB...");
+	log(SLOG_INFO, "Stitcher: Converting image to 16 bit...");
 	out_img.convertTo(out_cvt, CV_16U/*8UC3*/, 1);
 	out_img.release();
 	progress(1, 4, 5, "Encoding output file");
 	log(SLOG_INFO, "Stitcher: Encoding result into \""+path+"\"...");
 	imwrite(path, out_cvt);
 	log(SLOG_INFO, "Stitcher: Encoding completed!\a");
+	if (metrics) {
+		metrics->set(GAUGE_STITCH_SECONDS, (Metrics::now() - t_start) / 1e6);
+		metrics->publish(true);
+	}
 	progress(1, 5, 5, "Encoding output file");
 }
+
+/**
+ * Runs the stitcher in the background. set must not be touched until the job
+ * has finished.
+ */
+SolverJob SimpleStitcher::runAsync(ScanSet& set, std::string path, cv::Size cropSize, int decimation,
+                                   solve_done_cb_t cb, void* arg)
+{
+	return startJob([this, &set, path, cropSize, decimation]() { run(set, path, cropSize, decimation); }, cb, arg);
+}
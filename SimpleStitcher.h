@@ -1,11 +1,22 @@
 #pragma once
 
-#include "solver.h"
+#include "stitchapi.h"
+#include "Solver.h"
 #include "scanset.h"
 
-class __declspec(dllexport) SimpleStitcher : public Solver
+class STITCH_API SimpleStitcher : public Solver
 {
 public:
 	void run(ScanSet& set, std::string path, cv::Size cropSize, int decimation);
+	SolverJob runAsync(ScanSet& set, std::string path, cv::Size cropSize, int decimation,
+	                   solve_done_cb_t cb = nullptr, void* arg = nullptr);
+
+	/** Renders only region of the mosaic, in full resolution pixels from its top left. Empty for all of it */
+	void setRegion(cv::Rect region) { this->region = region; }
+	/** Keeps the tiles decoded after stitching, for callers that stitch the same set again */
+	void setKeepTiles(bool keep) { keepTiles = keep; }
+private:
+	cv::Rect region;
+	bool     keepTiles = false;
 };
 
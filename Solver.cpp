@@ -1,17 +1,192 @@
 #include "pch.h"
 #include "Solver.h"
-#include <varargs.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <exception>
+#include <thread>
 
-void Solver::logf(int level, const std::string fmt_str, ...)
+Solver::~Solver()
+{
+	/* Events still queued refer to this solver */
+	if (posted.load(std::memory_order_acquire))
+		eventChannel().forget(this);
+}
+
+/**
+ * Waits until every log message and progress update reported so far has been
+ * passed to the callbacks. Solvers that never reported anything return at
+ * once.
+ */
+void Solver::flushEvents()
+{
+	if (posted.load(std::memory_order_acquire))
+		eventChannel().flush(this);
+}
 
+static void copyText(char* dst, const std::string& src)
+{
+	size_t n = src.size() < EVENT_TEXT_SIZE - 1 ? src.size() : EVENT_TEXT_SIZE - 1;
+	memcpy(dst, src.data(), n);
+	dst[n] = 0;
+}
+
+void Solver::log(int level, const std::string& message)
+{
+	if (!logCB)
+		return;
+	posted.store(true, std::memory_order_release);
+	eventChannel().post([&](SolverEvent& e) {
+		e.solver = this;
+		e.kind   = EVENT_LOG;
+		e.level  = level;
+		e.key    = nullptr;
+		copyText(e.text, message);
+	});
+}
+
+void Solver::progress(int step, int n, int nmax, const std::string& message)
+{
+	if (!progressCB)
+		return;
+	posted.store(true, std::memory_order_release);
+	eventChannel().post([&](SolverEvent& e) {
+		e.solver = this;
+		e.kind   = EVENT_PROGRESS;
+		e.level  = step;
+		e.n      = n;
+		e.nmax   = nmax;
+		copyText(e.text, message);
+	});
+}
+
+/**
+ * Formats straight into the event record, so this does not allocate.
+ * Repeats of the same format string count as the same message for the
+ * rate limiting of warnings.
+ */
+void Solver::logf(int level, const char* fmt, ...)
 {
 	va_list ap;
-	char* fp = NULL;
-	std::string strBuf;
-	strBuf.resize(256);
-	va_start(ap, fmt_str);
-	sprintf_s((char*)strBuf.c_str(), strBuf.size(), fmt_str.c_str(), ap);
+
+	if (!logCB)
+		return;
+	va_start(ap, fmt);
+	posted.store(true, std::memory_order_release);
+	eventChannel().post([&](SolverEvent& e) {
+		e.solver = this;
+		e.kind   = EVENT_LOG;
+		e.level  = level;
+		e.key    = fmt;
+		vsnprintf(e.text, EVENT_TEXT_SIZE, fmt, ap);
+	});
 	va_end(ap);
-	log(level, strBuf);
+}
+
+/**
+ * Reports an error that ends the current call, and fails the running job.
+ */
+void Solver::fatal(std::string message)
+{
+	std::shared_ptr<JobState> j = std::atomic_load(&job);
+
+	if (j)
+		j->failed = true;
+	log(SLOG_ERROR, message);
+	if (fatalCB)
+		fatalCB(this, fatalArg, message);
+}
+
+/**
+ * Makes the solver run its parallel work on executor, which may be shared
+ * with other solvers. Pass null to go back to the default pool.
+ */
+void Solver::setExecutor(Executor* executor)
+{
+	ownPool.reset();
+	pool = executor;
+	numThreads = executor ? executor->concurrency() : 0;
+}
+
+/**
+ * Gives the solver a private pool of numThreads threads, optionally pinned to
+ * the listed cores. 0 goes back to the default pool, 1 runs everything on the
+ * calling thread.
+ */
+void Solver::setNumThreads(int numThreads, const std::vector<int>& cores)
+{
+	this->numThreads = numThreads;
+	if (numThreads <= 0)
+		ownPool.reset();
+	else if (numThreads == 1)
+		ownPool = std::make_shared<SerialExecutor>();
+	else
+		ownPool = std::make_shared<ThreadPool>(numThreads, cores);
+	pool = ownPool.get();
+}
+
+/**
+ * Asks the job started by the last asynchronous call to stop.
+ */
+void Solver::cancel()
+{
+	std::shared_ptr<JobState> j = std::atomic_load(&job);
+
+	if (j)
+		j->cancelRequested = true;
+}
+
+/**
+ * Runs work on a new thread as the current job of this solver. Only one job
+ * can run on a solver at a time.
+ *
+ * The solver must outlive the job: it may only be destroyed once the job
+ * has finished (SolverJob::finished, wait or the future), which is after
+ * the done callback has returned. The callback itself may start the next
+ * job, but must not destroy the solver.
+ *
+ * @param cb   Called from the job thread with the final status, may be null
+ */
+SolverJob Solver::startJob(std::function<void()> work, solve_done_cb_t cb, void* arg)
+{
+	std::shared_ptr<JobState> state = std::make_shared<JobState>();
+	std::shared_ptr<JobState> none;
+
+	if (!std::atomic_compare_exchange_strong(&job, &none, state)) {
+		log(SLOG_ERROR, "Solver is already running a job");
+		if (cb)
+			cb(this, arg, JOB_FAILED);
+		state->status = JOB_FAILED;
+		state->promise.set_value(JOB_FAILED);
+		return SolverJob(state);
+	}
+
+	std::thread([this, state, work, cb, arg]() {
+		int status;
+		try {
+			work();
+		}
+		catch (std::exception& e) {
+			state->failed = true;
+			log(SLOG_ERROR, std::string("Job failed: ") + e.what());
+		}
+		flushEvents();
+		if (state->failed)
+			status = JOB_FAILED;
+		else if (state->cancelRequested)
+			status = JOB_CANCELLED;
+		else
+			status = JOB_DONE;
+		/* Detach the job first, so that the done callback can start the
+		 * next one and later calls do not see this one. It only counts as
+		 * finished once the callback has returned, as the solver may be
+		 * destroyed from then on */
+		std::shared_ptr<JobState> self = state;
+		std::atomic_compare_exchange_strong(&job, &self, std::shared_ptr<JobState>());
+		if (cb)
+			cb(this, arg, status);
+		state->status = status;
+		state->promise.set_value(status);
+	}).detach();
+	return SolverJob(state);
 }
@@ -1,6 +1,14 @@
 #pragma once
 
+#include "stitchapi.h"
 #include <string>
+#include "Metrics.h"
+#include "Executor.h"
+#include "SolverJob.h"
+#include "EventChannel.h"
+#include <atomic>
+#include <functional>
+#include <memory>
 
 #define SLOG_TRACE (1)
 #define SLOG_DEBUG (2)
@@ -14,22 +22,57 @@ typedef void (*solve_fatal_cb_t   )(Solver*, void* arg, std::string message);
 typedef void (*solve_log_cb_t     )(Solver*, void* arg, int level, std::string message);
 typedef void (*solve_progress_cb_t)(Solver*, void* arg, int step, int n, int nmax, std::string message);
 
-class __declspec(dllexport)  Solver
+/**
+ * Base of all solvers.
+ *
+ * Log and progress callbacks are not called from the thread that reports
+ * them, but from the event channel's delivery thread (see EventChannel),
+ * one at a time and in order. Reporting from worker threads therefore never
+ * blocks on the host, and the host needs no locking in its callbacks.
+ * Fatal errors are reported synchronously.
+ */
+class STITCH_API Solver
 {
 public:
+	virtual ~Solver();
 	void setFatalCB(solve_fatal_cb_t cb, void* arg) { fatalCB = cb; fatalArg = arg; }
 	void setLogCB(solve_log_cb_t cb, void* arg) { logCB = cb; logArg = arg; }
 	void setProgressCB(solve_progress_cb_t cb, void* arg) { progressCB = cb; progressArg = arg; }
 	void setLogLevel(int level) { logLevel = level; }
+	void setMetrics(Metrics* metrics) { this->metrics = metrics; }
+	void setExecutor(Executor* executor);
+	void setNumThreads(int numThreads, const std::vector<int>& cores = std::vector<int>());
+	Executor& executor() { return pool ? *pool : defaultExecutor(); }
+	void cancel();
+	void flushEvents();
 
 protected:
 
-	void fatal(std::string message) { log(SLOG_ERROR, message); if (fatalCB) fatalCB(this, fatalArg, message); }
-	void log(int level, std::string message) { if (logCB) logCB(this, logArg, level, message); }
-	void progress(int step, int n, int nmax, std::string message) { if (progressCB) progressCB(this, progressArg, step, n, nmax, message); }
-	void logf(int level, const std::string fmt_str, ...);
+	void fatal(std::string message);
+	void log(int level, const std::string& message);
+	void progress(int step, int n, int nmax, const std::string& message);
+	void logf(int level, const char* fmt, ...);
+
+	/** True if the job this call runs in was asked to stop */
+	bool cancelled() const {
+		std::shared_ptr<JobState> j = std::atomic_load(&job);
+		return j && j->cancelRequested.load(std::memory_order_relaxed) && j->status.load() == JOB_RUNNING;
+	}
+	SolverJob startJob(std::function<void()> work, solve_done_cb_t cb, void* arg);
+
+	Metrics* metrics = nullptr;
 private:
-	int numThreads;
+	friend class EventChannel;
+	void deliverLog(int level, const std::string& message) { if (logCB) logCB(this, logArg, level, message); }
+	void deliverProgress(int step, int n, int nmax, const std::string& message) {
+		if (progressCB) progressCB(this, progressArg, step, n, nmax, message);
+	}
+
+	int numThreads = 0;
+	Executor* pool = nullptr;
+	std::shared_ptr<Executor> ownPool;
+	std::shared_ptr<JobState> job;   /* Running job, only accessed with std::atomic_load/store */
+	std::atomic<bool> posted{ false };   /* Events were posted, so the channel may refer to us */
 	int logLevel;
 	solve_fatal_cb_t fatalCB = nullptr;
 	void* fatalArg;
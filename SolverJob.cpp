@@ -0,0 +1,25 @@
+#include "pch.h"
+#include "SolverJob.h"
+#include <chrono>
+
+/**
+ * Blocks until the job has finished.
+ * @return the final status (JOB_DONE, JOB_CANCELLED or JOB_FAILED)
+ */
+int SolverJob::wait() const
+{
+	if (!state)
+		return JOB_FAILED;
+	return state->result.get();
+}
+
+/**
+ * Blocks until the job has finished or the timeout expired.
+ * @return true if the job has finished
+ */
+bool SolverJob::waitFor(double seconds) const
+{
+	if (!state)
+		return true;
+	return state->result.wait_for(std::chrono::duration<double>(seconds)) == std::future_status::ready;
+}
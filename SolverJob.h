@@ -0,0 +1,56 @@
+#pragma once
+
+#include "stitchapi.h"
+#include <atomic>
+#include <future>
+#include <memory>
+
+#define JOB_RUNNING   (0)
+#define JOB_DONE      (1)
+#define JOB_CANCELLED (2)
+#define JOB_FAILED    (3)
+
+class Solver;
+
+typedef void (*solve_done_cb_t)(Solver*, void* arg, int status);
+
+/**
+ * State shared between a running job and the handles to it.
+ */
+struct JobState
+{
+	std::atomic<bool>       cancelRequested;
+	std::atomic<bool>       failed;
+	std::atomic<int>        status;
+	std::promise<int>       promise;
+	std::shared_future<int> result;
+
+	JobState() : cancelRequested(false), failed(false), status(JOB_RUNNING), result(promise.get_future()) {}
+};
+
+/**
+ * Handle to a solver call running in the background, as returned by the
+ * *Async solver entry points. Copies refer to the same job.
+ *
+ * Cancellation is cooperative: the solver stops at the next pair, iteration
+ * or tile and leaves the results it did not complete untouched.
+ */
+class STITCH_API SolverJob
+{
+public:
+	SolverJob() {}
+	explicit SolverJob(std::shared_ptr<JobState> state) : state(state) {}
+
+	bool valid() const { return state != nullptr; }
+	void cancel() { if (state) state->cancelRequested = true; }
+	int status() const { return state ? state->status.load() : JOB_FAILED; }
+	bool finished() const { return status() != JOB_RUNNING; }
+
+	int wait() const;
+	bool waitFor(double seconds) const;
+
+	/** Future that becomes ready with the final status */
+	std::shared_future<int> future() const { return state ? state->result : std::shared_future<int>(); }
+private:
+	std::shared_ptr<JobState> state;
+};
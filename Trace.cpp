@@ -0,0 +1,122 @@
+#include "pch.h"
+#include "Trace.h"
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stdio.h>
+
+struct TraceEvent
+{
+	const char* name;
+	int64_t     start;
+	int64_t     end;
+	int         x, y, arg;
+};
+
+struct TraceBuffer
+{
+	int                     tid;
+	std::vector<TraceEvent> events;
+};
+
+std::atomic<bool> Tracer::active(false);
+
+/* Buffers are owned by the registry so they outlive the threads that
+ * filled them, threads only keep a pointer to their own */
+static std::mutex                                 registryLock;
+static std::vector<std::unique_ptr<TraceBuffer>>  registry;
+static thread_local TraceBuffer*                  localBuffer = nullptr;
+static thread_local int                           contextX = -1, contextY = -1;
+static int64_t                                    epoch = 0;
+
+static TraceBuffer* threadBuffer()
+{
+	if (!localBuffer) {
+		std::lock_guard<std::mutex> guard(registryLock);
+		registry.emplace_back(new TraceBuffer());
+		localBuffer = registry.back().get();
+		localBuffer->tid = (int)registry.size();
+		localBuffer->events.reserve(1 << 14);
+	}
+	return localBuffer;
+}
+
+int64_t Tracer::now()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Tracer::enable(bool on)
+{
+	if (on && epoch == 0)
+		epoch = now();
+	active.store(on);
+}
+
+void Tracer::clear()
+{
+	std::lock_guard<std::mutex> guard(registryLock);
+	for (auto& b : registry)
+		b->events.clear();
+	epoch = now();
+}
+
+void Tracer::record(const char* name, int64_t start, int64_t end, int x, int y, int arg)
+{
+	threadBuffer()->events.push_back(TraceEvent{ name, start, end, x, y, arg });
+}
+
+/**
+ * Writes all recorded spans as a Chrome trace event file, which can be
+ * opened in chrome://tracing or ui.perfetto.dev.
+ */
+bool Tracer::writeJson(std::string path)
+{
+	FILE* f = fopen(path.c_str(), "w");
+	bool first = true;
+
+	if (!f)
+		return false;
+	std::lock_guard<std::mutex> guard(registryLock);
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (auto& b : registry) {
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"name\":\"worker %i\"}}",
+			first ? "" : ",\n", b->tid, b->tid);
+		first = false;
+		for (TraceEvent& e : b->events) {
+			fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"stitch\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,"
+				"\"ts\":%lld,\"dur\":%lld,\"args\":{\"x\":%i,\"y\":%i,\"arg\":%i}}",
+				e.name, b->tid, (long long)(e.start - epoch), (long long)(e.end - e.start), e.x, e.y, e.arg);
+		}
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	return true;
+}
+
+TraceSpan::TraceSpan(const char* name, int x, int y, int arg) : name(name), start(-1), x(x), y(y), arg(arg)
+{
+	if (!Tracer::enabled())
+		return;
+	prevX = contextX;
+	prevY = contextY;
+	if (x < 0) {
+		this->x = contextX;
+		this->y = contextY;
+	} else {
+		contextX = x;
+		contextY = y;
+	}
+	start = Tracer::now();
+}
+
+TraceSpan::~TraceSpan()
+{
+	if (start < 0)
+		return;
+	Tracer::record(name, start, Tracer::now(), x, y, arg);
+	contextX = prevX;
+	contextY = prevY;
+}
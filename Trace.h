@@ -0,0 +1,44 @@
+#pragma once
+
+#include "stitchapi.h"
+#include <stdint.h>
+#include <string>
+#include <atomic>
+
+/**
+ * Opt-in timeline tracing. Spans are recorded into per-thread buffers without
+ * any locking and can be exported as a Chrome trace / Perfetto JSON file.
+ *
+ * Tracing is off by default, in which case a span costs a single relaxed
+ * load. Export should happen while no solver is running.
+ */
+class STITCH_API Tracer
+{
+public:
+	static void enable(bool on);
+	static bool enabled() { return active.load(std::memory_order_relaxed); }
+	static void clear();
+	static bool writeJson(std::string path);
+
+	static void record(const char* name, int64_t start, int64_t end, int x, int y, int arg);
+	static int64_t now();
+private:
+	static std::atomic<bool> active;
+};
+
+/**
+ * Records a span covering the lifetime of the object. Spans that are given
+ * tile coordinates pass them on to the spans nested inside them on the same
+ * thread, so eg. a tile load inside a pair is attributed to that pair.
+ */
+class STITCH_API TraceSpan
+{
+public:
+	TraceSpan(const char* name, int x = -1, int y = -1, int arg = -1);
+	~TraceSpan();
+private:
+	const char* name;
+	int64_t     start;
+	int         x, y, arg;
+	int         prevX, prevY;
+};
@@ -0,0 +1,322 @@
+/*
+ * Micro benchmarks for the hot kernels of the library.
+ *
+ * Usage: microstitch_bench [--reps N] [--threads 1,2,4] [--filter name] [--quick]
+ *
+ * Every case is run --reps times after one warm up run, the minimum and
+ * median wall time are reported. Input images are synthetic, seeded from a
+ * fixed value so runs are comparable between builds.
+ */
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+#include "stitch.h"
+#include "EdgeMap.h"
+#include "scanset.h"
+#include "AffineOverlapSolver.h"
+#include "RelaxationSolver.h"
+#include "SimpleStitcher.h"
+
+using namespace cv;
+
+static int                 reps = 5;
+static bool                quick = false;
+static std::string         filter;
+static std::vector<int>    threadCounts;
+
+static const char* typeName(int type)
+{
+	switch (type) {
+	case CV_8U:  return "8U";
+	case CV_16U: return "16U";
+	case CV_32F: return "32F";
+	default:     return "?";
+	}
+}
+
+/**
+ * Generates a smooth random texture, scaled to the value range of type.
+ */
+static Mat makeTexture(Size size, int type, uint64_t seed)
+{
+	Mat noise(size, CV_32F), out;
+	RNG rng(seed);
+	double scale = type == CV_8U ? 255. : type == CV_16U ? 65535. : 1.;
+
+	rng.fill(noise, RNG::UNIFORM, Scalar(0), Scalar(1));
+	GaussianBlur(noise, noise, Size(0, 0), 2.0);
+	noise.convertTo(out, type, scale);
+	return out;
+}
+
+/**
+ * Cuts two overlapping tiles out of one texture, B displaced by shift from A.
+ */
+static void makePair(Size tile, int type, Point2i shift, Mat& a, Mat& b)
+{
+	Point2i margin(abs(shift.x), abs(shift.y));
+	Mat scene = makeTexture(Size(tile.width + 2 * margin.x, tile.height + 2 * margin.y), type, 1234);
+
+	a = scene(Rect(margin, tile)).clone();
+	b = scene(Rect(margin + shift, tile)).clone();
+}
+
+static void runCase(const std::string& kernel, const std::string& params, std::function<void()> fn)
+{
+	std::vector<double> times;
+
+	if (!filter.empty() && kernel.find(filter) == std::string::npos)
+		return;
+
+	fn();
+	for (int i = 0; i < reps; i++) {
+		auto t0 = std::chrono::steady_clock::now();
+		fn();
+		auto t1 = std::chrono::steady_clock::now();
+		times.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+	}
+	std::sort(times.begin(), times.end());
+	printf("%-18s %-40s %12.3f %12.3f\n", kernel.c_str(), params.c_str(), times[0], times[times.size() / 2]);
+	fflush(stdout);
+}
+
+static void benchScoreOverlap()
+{
+	int sizes[] = { 256, 512, 1024 };
+	int types[] = { CV_8U, CV_16U, CV_32F };
+
+	for (int sz : sizes) {
+		for (int type : types) {
+			Mat a, b;
+			Point2i dr(sz / 8, sz / 16);
+			makePair(Size(sz, sz), type, dr, a, b);
+			char params[64];
+			snprintf(params, sizeof params, "tile=%i type=%s", sz, typeName(type));
+			runCase("scoreOverlap", params, [&]() {
+				for (int i = 0; i < 16; i++)
+					scoreOverlap(a, b, dr);
+			});
+		}
+	}
+}
+
+static void benchScoreEdgeOverlap()
+{
+	int sizes[] = { 256, 512, 1024 };
+
+	for (int sz : sizes) {
+		Mat a, b, grad, bitsA, bitsB;
+		EdgeMap ea, eb;
+		Point2i dr(sz / 8, sz / 16);
+		makePair(Size(sz, sz), CV_16U, dr, a, b);
+		ea.build(a, grad, bitsA);
+		eb.build(b, grad, bitsB);
+		char params[64];
+		snprintf(params, sizeof params, "tile=%i", sz);
+		runCase("scoreEdgeOverlap", params, [&]() {
+			for (int i = 0; i < 16; i++)
+				scoreEdgeOverlap(ea, eb, dr);
+		});
+		runCase("EdgeMap::build", params, [&]() {
+			ea.build(a, grad, bitsA);
+		});
+	}
+}
+
+static void benchFindBestOverlap()
+{
+	int sizes[] = { 256, 512 };
+	int ranges[] = { 8, 32 };
+	int decimations[] = { 1, 4 };
+
+	for (int sz : sizes) {
+		for (int range : ranges) {
+			for (int dec : decimations) {
+				if (quick && (sz > 256 || (dec == 1 && range > 8)))
+					continue;
+				Mat a, b;
+				Point2i dr(sz / 8, 0), res;
+				makePair(Size(sz, sz), CV_32F, dr, a, b);
+				char params[64];
+				snprintf(params, sizeof params, "tile=%i range=%i decimate=%i", sz, range, dec);
+				runCase("findBestOverlap", params, [&]() {
+					findBestOverlap(a, b, dr, Point2i(range, range), dec, res);
+				});
+			}
+		}
+	}
+}
+
+static void benchIterBestOverlapNC()
+{
+	int sizes[] = { 512, 1024 };
+	int types[] = { CV_16U, CV_32F };
+	int ranges[] = { 32, 128 };
+
+	for (int sz : sizes) {
+		for (int type : types) {
+			for (int range : ranges) {
+				if (quick && (sz > 512 || range > 32))
+					continue;
+				Mat a, b;
+				Point2i dr(sz / 8, 5), res;
+				makePair(Size(sz, sz), type, dr, a, b);
+				char params[64];
+				snprintf(params, sizeof params, "tile=%i type=%s range=%i logd=3", sz, typeName(type), range);
+				runCase("iterBestOverlapNC", params, [&]() {
+					iterBestOverlapNC(a, b, dr + Point2i(3, -2), Point2i(range, range), 3, res);
+				});
+				runCase("iterBestOverlapEdge", params, [&]() {
+					iterBestOverlapEdge(a, b, dr + Point2i(3, -2), Point2i(range, range), 3, res, false);
+				});
+				runCase("iterBestOverlapSparse", params, [&]() {
+					iterBestOverlapEngine(a, b, dr + Point2i(3, -2), Point2i(range, range), 3, res, OVERLAP_ENGINE_SPARSE);
+				});
+			}
+		}
+	}
+}
+
+/**
+ * Builds a memory backed scan set of w x h tiles cut from one texture, with
+ * the stage positions set to the true tile positions.
+ */
+static void makeScanSet(ScanSet& set, int w, int h, Size tile, Point2i step, bool pixels)
+{
+	Mat scene;
+
+	if (pixels)
+		scene = makeTexture(Size(step.x * (w - 1) + tile.width, step.y * (h - 1) + tile.height), CV_16U, 42);
+	for (int y = 0; y < h; y++) {
+		for (int x = 0; x < w; x++) {
+			Point2i p(x * step.x, y * step.y);
+			Mat t = pixels ? scene(Rect(p, tile)).clone() : Mat(1, 1, CV_16U, Scalar(0));
+			set.addImage(std::move(t), Point2i(x, y), Point2f(p));
+		}
+	}
+	set.generateGrid();
+	set.affineStageToImage = Matx23f(1, 0, 0, 0, 1, 0);
+}
+
+static void benchComputeOverlaps()
+{
+	int grid = quick ? 4 : 8;
+
+	for (int threads : threadCounts) {
+		ScanSet set;
+		AffineOverlapSolver solver;
+		makeScanSet(set, grid, grid, Size(640, 512), Point2i(560, 448), true);
+		solver.setParameters(GUESS_STAGE, 1000, 2, Size(640, 512), Point2i(16, 16), Point2i(16, 16));
+		char params[64];
+		snprintf(params, sizeof params, "grid=%ix%i range=16 logd=2 threads=%i", grid, grid, threads);
+		solver.setNumThreads(threads);
+		setNumThreads(threads);
+		runCase("computeOverlapsY", params, [&]() {
+			solver.computeOverlapsY(set);
+		});
+	}
+}
+
+static void benchRelaxation()
+{
+	int grids[] = { 20, 100, 300 };
+	Point2i step(560, 448);
+	RNG rng(7);
+
+	for (int g : grids) {
+		if (quick && g > 20)
+			continue;
+		ScanSet set;
+		RelaxationSolver relax;
+		makeScanSet(set, g, g, Size(1, 1), step, false);
+		for (int y = 0; y < g; y++) {
+			for (int x = 0; x < g; x++) {
+				Point2i jitter(rng.uniform(-3, 4), rng.uniform(-3, 4));
+				if (x + 1 < g)
+					set.setDisplacement(Point2i(x, y), DISP_RIGHT, Point2i(step.x, 0) + jitter);
+				if (y + 1 < g)
+					set.setDisplacement(Point2i(x, y), DISP_DOWN, Point2i(0, step.y) + jitter);
+				set.stitchPositionAt(x, y) = Point2i(x * step.x, y * step.y);
+			}
+		}
+		char params[64];
+		snprintf(params, sizeof params, "grid=%ix%i iters=50", g, g);
+		runCase("RelaxationSolver", params, [&]() {
+			relax.setup(set, 200);
+			relax.run(50);
+		});
+	}
+}
+
+static void benchStitcher()
+{
+	int grids[] = { 4, 8 };
+	int decimations[] = { 1, 4 };
+	Point2i step(560, 448);
+
+	for (int g : grids) {
+		for (int dec : decimations) {
+			if (quick && (g > 4 || dec == 1))
+				continue;
+			ScanSet set;
+			SimpleStitcher stitcher;
+			makeScanSet(set, g, g, Size(640, 512), step, true);
+			for (int y = 0; y < g; y++)
+				for (int x = 0; x < g; x++)
+					set.stitchPositionAt(x, y) = Point2i(x * step.x, y * step.y);
+			set.stitchRect = Rect(Point2i(0, 0), Point2i((g - 1) * step.x, (g - 1) * step.y));
+			char params[64];
+			snprintf(params, sizeof params, "grid=%ix%i tile=640x512 decimate=%i", g, g, dec);
+			runCase("SimpleStitcher", params, [&]() {
+				stitcher.run(set, "microstitch_bench_out.tif", Size(600, 480), dec);
+			});
+		}
+	}
+	remove("microstitch_bench_out.tif");
+}
+
+int main(int argc, char** argv)
+{
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--reps") && i + 1 < argc)
+			reps = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--filter") && i + 1 < argc)
+			filter = argv[++i];
+		else if (!strcmp(argv[i], "--quick"))
+			quick = true;
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			for (char* t = strtok(argv[++i], ","); t; t = strtok(nullptr, ","))
+				threadCounts.push_back(atoi(t));
+		}
+		else {
+			fprintf(stderr, "usage: %s [--reps N] [--threads 1,2,4] [--filter name] [--quick]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (threadCounts.empty()) {
+		threadCounts.push_back(1);
+		if (std::thread::hardware_concurrency() > 1)
+			threadCounts.push_back((int)std::thread::hardware_concurrency());
+	}
+	if (reps < 1)
+		reps = 1;
+
+	printf("%-18s %-40s %12s %12s\n", "kernel", "parameters", "min ms", "median ms");
+	benchScoreOverlap();
+	benchScoreEdgeOverlap();
+	benchFindBestOverlap();
+	benchIterBestOverlapNC();
+	benchComputeOverlaps();
+	benchRelaxation();
+	benchStitcher();
+	return 0;
+}
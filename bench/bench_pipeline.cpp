@@ -0,0 +1,404 @@
+/*
+ * Runs the full stitching pipeline on a scan and reports the time taken by
+ * every stage, the peak memory use and, for synthetic scans, the error of the
+ * solved tile positions against the ground truth.
+ *
+ * Usage: microstitch_pipeline --project PATH [options]
+ *        microstitch_pipeline --out DIR [synthetic scan options] [options]
+ *
+ * With --out a synthetic scan is generated into DIR first (see microstitch_synth).
+ */
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#else
+#include <sys/resource.h>
+#endif
+
+#include "synthscan.h"
+#include "scanset.h"
+#include "AffineOverlapSolver.h"
+#include "RelaxationSolver.h"
+#include "SimpleStitcher.h"
+
+using namespace cv;
+
+struct PipelineOptions
+{
+	std::string project;
+	std::string out;
+	std::string stitch;
+	std::string flat;
+	std::string dark;
+	Size        crop;
+	Point2i     step;
+	int         range = 0;
+	int         matrixRange = 32;
+	int         logd = 2;
+	int         iters = 500;
+	int         sanity = 100;
+	int         decimate = 4;
+	int         threads = 0;
+	float       remeasure = 0;
+	double      autotune = 0;
+	int         calibrate = 0;
+	float       fitError = 4;
+	bool        verbose = false;
+	bool        adaptive = false;
+	bool        color = false;
+	int         engine = OVERLAP_ENGINE_SSD;
+};
+
+static void logCallback(Solver*, void* arg, int level, std::string message)
+{
+	bool verbose = *(bool*)arg;
+
+	if (verbose || level >= SLOG_WARN)
+		fprintf(stderr, "%s\n", message.c_str());
+}
+
+/**
+ * @return the peak resident set size of the process so far, in MiB
+ */
+static double peakMemoryMiB()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof pmc))
+		return pmc.PeakWorkingSetSize / 1048576.;
+	return 0;
+#else
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+	return ru.ru_maxrss / 1048576.;
+#else
+	return ru.ru_maxrss / 1024.;
+#endif
+#endif
+}
+
+class StageTimer
+{
+public:
+	StageTimer() { printf("%-14s %10s %12s\n", "stage", "seconds", "peak MiB"); }
+	void start() { t0 = std::chrono::steady_clock::now(); }
+	void stop(const char* stage) {
+		double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		printf("%-14s %10.3f %12.1f\n", stage, s, peakMemoryMiB());
+		fflush(stdout);
+	}
+private:
+	std::chrono::steady_clock::time_point t0;
+};
+
+/**
+ * Prints the RMS and maximum distance between the positions in the scan set
+ * and the ground truth, after removing the mean offset between the two (the
+ * solution is only defined up to a translation).
+ */
+static void reportError(const char* label, ScanSet& set, const std::vector<Point2i>& truth)
+{
+	int n = set.gridWidth * set.gridHeight;
+	Point2d mean(0, 0);
+	double sq = 0, worst = 0;
+
+	for (int i = 0; i < n; i++)
+		mean += Point2d(set.stitchPositions[i] - truth[i]);
+	mean /= n;
+	for (int i = 0; i < n; i++) {
+		double e = norm(Point2d(set.stitchPositions[i] - truth[i]) - mean);
+		sq += e * e;
+		worst = e > worst ? e : worst;
+	}
+	printf("%-14s rms %.3f px, max %.3f px\n", label, sqrt(sq / n), worst);
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr,
+		"usage: %s --project PATH [options]\n"
+		"       %s --out DIR [synthetic scan options] [options]\n"
+		"options:\n"
+		"  --crop WxH          crop tiles to this size (tile size)\n"
+		"  --nominal-step XxY  nominal tile step in pixels for the matrix calibration (from project)\n"
+		"  --range N           overlap search range (16, or sized from the calibration)\n"
+		"  --matrix-range N    search range for the matrix calibration (32)\n"
+		"  --calibrate N       calibrate the matrix from about N pairs across the grid\n"
+		"  --fit-error PX      largest residual of a calibration pair counted as inlier (4)\n"
+		"  --logd N            log2 of the coarsest decimation (2)\n"
+		"  --iters N           relaxation iterations (500)\n"
+		"  --sanity N          relaxation max sanity difference (100)\n"
+		"  --autotune SECONDS  tune the overlap search parameters within this time first\n"
+		"  --remeasure PX      re-measure pairs off the solution by more than PX and solve again\n"
+		"  --stitch PATH       also stitch the result to PATH\n"
+		"  --decimate N        stitch decimation (4)\n"
+		"  --threads N         number of threads (all)\n"
+		"  --adaptive          predict guesses from neighbouring pairs (GUESS_ADAPTIVE)\n"
+		"  --engine NAME       pair scoring: ssd, edge, edge-ssd or sparse (ssd)\n"
+		"  --color             load colour tiles, align on luminance and stitch in colour\n"
+		"  --flat PATH         flat-field reference image\n"
+		"  --dark PATH         dark-frame reference image\n"
+		"  --verbose           show solver log messages\n"
+		"synthetic scan options:\n" SYNTH_USAGE, name, name);
+}
+
+int main(int argc, char** argv)
+{
+	PipelineOptions opt;
+	SynthScanParams synth;
+	std::vector<Point2i> truth;
+	int truthW = 0, truthH = 0;
+	Metrics metrics;
+	MetricsSnapshot snap;
+
+	for (int i = 1; i < argc; i++) {
+		std::string a = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (a == "--verbose")
+			opt.verbose = true;
+		else if (a == "--adaptive")
+			opt.adaptive = true;
+		else if (a == "--color")
+			opt.color = true;
+		else if (a == "--project" && hasValue)
+			opt.project = argv[++i];
+		else if (a == "--out" && hasValue)
+			opt.out = argv[++i];
+		else if (a == "--stitch" && hasValue)
+			opt.stitch = argv[++i];
+		else if (a == "--flat" && hasValue)
+			opt.flat = argv[++i];
+		else if (a == "--dark" && hasValue)
+			opt.dark = argv[++i];
+		else if (a == "--crop" && hasValue)
+			sscanf(argv[++i], "%ix%i", &opt.crop.width, &opt.crop.height);
+		else if (a == "--nominal-step" && hasValue)
+			sscanf(argv[++i], "%ix%i", &opt.step.x, &opt.step.y);
+		else if (a == "--range" && hasValue)
+			opt.range = atoi(argv[++i]);
+		else if (a == "--matrix-range" && hasValue)
+			opt.matrixRange = atoi(argv[++i]);
+		else if (a == "--logd" && hasValue)
+			opt.logd = atoi(argv[++i]);
+		else if (a == "--iters" && hasValue)
+			opt.iters = atoi(argv[++i]);
+		else if (a == "--sanity" && hasValue)
+			opt.sanity = atoi(argv[++i]);
+		else if (a == "--engine" && hasValue) {
+			std::string e = argv[++i];
+			if (e == "ssd")
+				opt.engine = OVERLAP_ENGINE_SSD;
+			else if (e == "edge")
+				opt.engine = OVERLAP_ENGINE_EDGE;
+			else if (e == "edge-ssd")
+				opt.engine = OVERLAP_ENGINE_EDGE_SSD;
+			else if (e == "sparse")
+				opt.engine = OVERLAP_ENGINE_SPARSE;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+		}
+		else if (a == "--decimate" && hasValue)
+			opt.decimate = atoi(argv[++i]);
+		else if (a == "--threads" && hasValue)
+			opt.threads = atoi(argv[++i]);
+		else if (a == "--calibrate" && hasValue)
+			opt.calibrate = atoi(argv[++i]);
+		else if (a == "--fit-error" && hasValue)
+			opt.fitError = (float)atof(argv[++i]);
+		else if (a == "--autotune" && hasValue)
+			opt.autotune = atof(argv[++i]);
+		else if (a == "--remeasure" && hasValue)
+			opt.remeasure = (float)atof(argv[++i]);
+		else if (!parseSynthArg(argc, argv, i, synth)) {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (opt.project.empty() == opt.out.empty()) {
+		usage(argv[0]);
+		return 1;
+	}
+	/* One pool shared by all solvers, OpenCV's own threads are limited to match */
+	ThreadPool pool(opt.threads);
+	if (opt.threads > 0)
+		setNumThreads(opt.threads);
+
+	StageTimer timer;
+
+	if (!opt.out.empty()) {
+		SynthScan scan;
+		timer.start();
+		mkdir(opt.out.c_str(), 0755);
+		opt.project = opt.out + "/project.yml";
+		if (!scan.setup(synth) || !scan.writeProject(opt.out, opt.project)) {
+			fprintf(stderr, "could not generate the synthetic scan\n");
+			return 1;
+		}
+		timer.stop("generate");
+	}
+
+	/* Take the nominal step from a synthetic project, unless overridden */
+	{
+		FileStorage fs(opt.project, FileStorage::READ);
+		FileNode s = fs["synth"];
+		if (!s.empty() && opt.step == Point2i(0, 0))
+			opt.step = Point2i((int)s["step"][0], (int)s["step"][1]);
+	}
+	if (opt.step == Point2i(0, 0)) {
+		fprintf(stderr, "the nominal tile step is not known, use --nominal-step\n");
+		return 1;
+	}
+
+	ScanSet set;
+	AffineOverlapSolver solver;
+	RelaxationSolver relax;
+	SimpleStitcher stitcher;
+
+	solver.setLogCB(logCallback, &opt.verbose);
+	relax.setLogCB(logCallback, &opt.verbose);
+	stitcher.setLogCB(logCallback, &opt.verbose);
+	solver.setMetrics(&metrics);
+	relax.setMetrics(&metrics);
+	stitcher.setMetrics(&metrics);
+	solver.setExecutor(&pool);
+	relax.setExecutor(&pool);
+	stitcher.setExecutor(&pool);
+
+	timer.start();
+	set.loadInput(opt.project);
+	if (set.m_Images.empty()) {
+		fprintf(stderr, "no images in \"%s\"\n", opt.project.c_str());
+		return 1;
+	}
+	if (!set.generateGrid()) {
+		fprintf(stderr, "the tiles of \"%s\" do not form a regular grid\n", opt.project.c_str());
+		return 1;
+	}
+	set.setMetrics(&metrics);
+	set.setColor(opt.color);
+	if (!opt.flat.empty() || !opt.dark.empty()) {
+		int flags = IMREAD_ANYDEPTH | (opt.color ? IMREAD_ANYCOLOR : 0);
+		Mat flat = opt.flat.empty() ? Mat() : imread(opt.flat, flags);
+		Mat dark = opt.dark.empty() ? Mat() : imread(opt.dark, flags);
+		if ((!opt.flat.empty() && flat.empty()) || (!opt.dark.empty() && dark.empty()) || !set.setFlatField(flat, dark)) {
+			fprintf(stderr, "could not use the flat-field references\n");
+			return 1;
+		}
+	}
+	if (opt.crop.area() == 0) {
+		Mat first;
+		if (!set.imageAt(0, 0).getImage(first)) {
+			fprintf(stderr, "could not read \"%s\"\n", set.imageAt(0, 0).path.c_str());
+			return 1;
+		}
+		opt.crop = first.size();
+	}
+	timer.stop("load");
+
+	if (loadSynthTruth(opt.project, truthW, truthH, truth) &&
+	    (truthW != set.gridWidth || truthH != set.gridHeight))
+		truth.clear();
+
+	/* Calibrate the stage to image matrix, from pairs across the grid or
+	 * around the centre of the scan */
+	timer.start();
+	solver.setParameters(GUESS_FIXED, 1000, opt.logd, opt.crop,
+	                     Point2i(opt.matrixRange, opt.matrixRange), Point2i(opt.matrixRange, opt.matrixRange));
+	solver.setFixedGuess(Point2i(opt.step.x, 0), Point2i(0, opt.step.y));
+	if (opt.calibrate > 0) {
+		MatrixFit fit = solver.computeMatrixSampled(set, opt.calibrate, opt.fitError);
+		/* Leave room for three times the worst calibration residual */
+		if (opt.range == 0 && fit.inliers >= 2)
+			opt.range = std::max(4, (int)ceil(3 * std::max(fit.spread.x, fit.spread.y)));
+		printf("%-14s %i/%i pairs, rms %.2f px, spread %.1fx%.1f px\n", "calibration",
+		       fit.inliers, fit.samples, fit.rms, fit.spread.x, fit.spread.y);
+	}
+	else
+		solver.computeMatrix(set, (set.gridWidth - 1) / 2, (set.gridHeight - 1) / 2);
+	solver.applyInitialGrid(set);
+	timer.stop("matrix");
+	if (!truth.empty())
+		reportError("stage error", set, truth);
+	if (opt.range == 0)
+		opt.range = 16;
+	printf("%-14s %i px\n", "search range", opt.range);
+
+	solver.setParameters(GUESS_STAGE, 4 * opt.range, opt.logd, opt.crop,
+	                     Point2i(opt.range, opt.range), Point2i(opt.range, opt.range));
+	/* The calibration above always scores with SSD */
+	solver.setEngine(opt.engine);
+	if (opt.autotune > 0) {
+		timer.start();
+		OverlapParams tuned = solver.autoTune(set, 16, opt.autotune);
+		solver.setParameters(tuned);
+		timer.stop("autotune");
+		printf("%-14s logd %i, crop %ix%i, range %ix%i / %ix%i\n", "tuned", tuned.logSteps,
+		       tuned.cropSize.width, tuned.cropSize.height, tuned.rangeH.x, tuned.rangeH.y, tuned.rangeV.x, tuned.rangeV.y);
+	}
+	if (opt.adaptive)
+		solver.setGuessMode(GUESS_ADAPTIVE);
+	timer.start();
+	solver.computeOverlapsY(set);
+	timer.stop("overlaps_y");
+	timer.start();
+	solver.computeOverlapsX(set);
+	timer.stop("overlaps_x");
+
+	timer.start();
+	relax.setup(set, opt.sanity);
+	relax.run(opt.iters);
+	timer.stop("relax");
+	if (!truth.empty())
+		reportError("solved error", set, truth);
+
+	if (opt.remeasure > 0) {
+		timer.start();
+		int changed = solver.remeasureOutliers(set, opt.remeasure);
+		timer.stop("remeasure");
+		if (changed) {
+			timer.start();
+			relax.setup(set, opt.sanity);
+			relax.run(opt.iters);
+			timer.stop("relax_again");
+			if (!truth.empty())
+				reportError("fixed error", set, truth);
+		}
+	}
+
+	if (!opt.stitch.empty()) {
+		timer.start();
+		stitcher.run(set, opt.stitch, opt.crop, opt.decimate);
+		timer.stop("stitch");
+	}
+
+	metrics.snapshot(snap);
+	uint64_t evals = 0;
+	for (int l = 0; l < METRIC_MAX_LEVELS; l++)
+		evals += snap.counters[METRIC_SCORE_EVALS + l];
+	printf("tiles %i, pairs %llu, widened %llu, remeasured %llu, score evaluations %llu, decoded %llu, pair p50 %.0f us, p99 %.0f us\n",
+	       set.gridWidth * set.gridHeight,
+	       (unsigned long long)snap.counters[METRIC_PAIRS_MEASURED],
+	       (unsigned long long)snap.counters[METRIC_PAIRS_WIDENED],
+	       (unsigned long long)snap.counters[METRIC_PAIRS_REMEASURED],
+	       (unsigned long long)evals,
+	       (unsigned long long)snap.counters[METRIC_TILES_DECODED],
+	       snap.histograms[HIST_PAIR_US].percentile(0.5),
+	       snap.histograms[HIST_PAIR_US].percentile(0.99));
+	return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * Writes a synthetic scan with known tile positions to disk.
+ *
+ * Usage: microstitch_synth [options] OUTDIR
+ *
+ * The tiles are written as OUTDIR/tile_XXXX_YYYY.png, the project file as
+ * OUTDIR/project.yml. The project can be loaded with ScanSet::loadInput and
+ * fed to microstitch_pipeline to check the accuracy of the solvers.
+ */
+#include "synthscan.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#endif
+
+int main(int argc, char** argv)
+{
+	SynthScanParams params;
+	SynthScan scan;
+	std::string dir;
+
+	for (int i = 1; i < argc; i++) {
+		if (argv[i][0] != '-' && dir.empty())
+			dir = argv[i];
+		else if (!parseSynthArg(argc, argv, i, params)) {
+			fprintf(stderr, "usage: %s [options] OUTDIR\n" SYNTH_USAGE, argv[0]);
+			return 1;
+		}
+	}
+	if (dir.empty()) {
+		fprintf(stderr, "usage: %s [options] OUTDIR\n" SYNTH_USAGE, argv[0]);
+		return 1;
+	}
+
+	mkdir(dir.c_str(), 0755);
+	if (!scan.setup(params))
+		return 1;
+	printf("Writing %ix%i tiles of %ix%i to %s...\n", params.gridWidth, params.gridHeight,
+	       params.tileSize.width, params.tileSize.height, dir.c_str());
+	if (!scan.writeProject(dir, dir + "/project.yml")) {
+		fprintf(stderr, "could not write the scan\n");
+		return 1;
+	}
+	printf("Done, project is %s/project.yml\n", dir.c_str());
+	return 0;
+}
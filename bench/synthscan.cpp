@@ -0,0 +1,239 @@
+#include "synthscan.h"
+#include "Executor.h"
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <atomic>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace cv;
+
+#define TEXTURE_SIZE (2048)
+
+/**
+ * Builds a seamlessly repeating texture with both fine and coarse structure,
+ * normalised to 0..1. The period is large compared to the overlap search
+ * ranges, so the repetition can not cause false matches.
+ */
+static void makePeriodicTexture(uint64_t seed, Mat& out)
+{
+	double sigmas[] = { 1.5, 6.0, 24.0 };
+	double weights[] = { 0.5, 0.3, 0.2 };
+	RNG rng(seed);
+	Mat noise(TEXTURE_SIZE, TEXTURE_SIZE, CV_32F), padded, blurred;
+
+	out = Mat::zeros(TEXTURE_SIZE, TEXTURE_SIZE, CV_32F);
+	for (int i = 0; i < 3; i++) {
+		int r = (int)ceil(sigmas[i] * 4);
+		rng.fill(noise, RNG::UNIFORM, Scalar(0), Scalar(1));
+		/* Wrap the borders so the blurred result tiles seamlessly */
+		copyMakeBorder(noise, padded, r, r, r, r, BORDER_WRAP);
+		GaussianBlur(padded, blurred, Size(0, 0), sigmas[i]);
+		normalize(blurred(Rect(r, r, TEXTURE_SIZE, TEXTURE_SIZE)), blurred, 0., 1., NORM_MINMAX);
+		out += blurred * weights[i];
+	}
+	normalize(out, out, 0., 1., NORM_MINMAX);
+}
+
+bool SynthScan::setup(const SynthScanParams& params)
+{
+	RNG rng(params.seed);
+	int n = params.gridWidth * params.gridHeight;
+	int margin = (int)ceil(params.offset);
+	double a = params.rotation * CV_PI / 180.;
+
+	this->params = params;
+	truth.resize(n);
+	stage.resize(n);
+
+	for (int y = 0; y < params.gridHeight; y++) {
+		for (int x = 0; x < params.gridWidth; x++) {
+			int i = y * params.gridWidth + x;
+			Point2i p(x * params.step.x + margin, y * params.step.y + margin);
+			p.x += (int)lround(rng.uniform(-params.offset, params.offset));
+			p.y += (int)lround(rng.uniform(-params.offset, params.offset));
+			truth[i] = p;
+
+			/* The stage reads the true position with some error, in rotated and scaled stage units */
+			Point2d r(p.x + rng.gaussian(params.jitter), p.y + rng.gaussian(params.jitter));
+			stage[i] = Point2f((float)(params.stageScale * (cos(a) * r.x + sin(a) * r.y)),
+			                   (float)(params.stageScale * (-sin(a) * r.x + cos(a) * r.y)));
+		}
+	}
+
+	if (params.source.empty()) {
+		makePeriodicTexture(params.seed, texture);
+	}
+	else {
+		Mat src = imread(params.source, IMREAD_GRAYSCALE | IMREAD_ANYDEPTH);
+		Point2i extent = Point2i(params.step.x * (params.gridWidth - 1), params.step.y * (params.gridHeight - 1)) +
+		                 Point2i(params.tileSize) + Point2i(2 * margin, 2 * margin);
+		if (src.empty()) {
+			fprintf(stderr, "could not read source image \"%s\"\n", params.source.c_str());
+			return false;
+		}
+		if (src.cols < extent.x || src.rows < extent.y) {
+			fprintf(stderr, "source image is %ix%i, the scan needs at least %ix%i\n",
+			        src.cols, src.rows, extent.x, extent.y);
+			return false;
+		}
+		src.convertTo(scene, CV_32F);
+		normalize(scene, scene, 0., 1., NORM_MINMAX);
+	}
+
+	/* Radial brightness falloff towards the tile corners */
+	gain.create(params.tileSize, CV_32F);
+	Point2f c((params.tileSize.width - 1) / 2.f, (params.tileSize.height - 1) / 2.f);
+	float rmax2 = c.dot(c);
+	for (int y = 0; y < gain.rows; y++) {
+		float* g = gain.ptr<float>(y);
+		for (int x = 0; x < gain.cols; x++) {
+			Point2f d(x - c.x, y - c.y);
+			g[x] = (float)(1. - params.vignetting * d.dot(d) / rmax2);
+		}
+	}
+	return true;
+}
+
+/**
+ * Renders tile (x,y) as the camera would have recorded it.
+ */
+void SynthScan::renderTile(int x, int y, cv::Mat& tile) const
+{
+	Point2i p = truthAt(x, y);
+	Mat f(params.tileSize, CV_32F), n(params.tileSize, CV_32F);
+	RNG rng(params.seed * 0x9E3779B97F4A7C15ULL + (uint64_t)(y * params.gridWidth + x) + 1);
+
+	if (!scene.empty()) {
+		scene(Rect(p, params.tileSize)).copyTo(f);
+	}
+	else {
+		for (int ty = 0; ty < f.rows; ty++) {
+			const float* src = texture.ptr<float>((p.y + ty) % TEXTURE_SIZE);
+			float* dst = f.ptr<float>(ty);
+			for (int tx = 0; tx < f.cols; tx++)
+				dst[tx] = src[(p.x + tx) % TEXTURE_SIZE];
+		}
+		/* Keep clear of the ends of the range so noise does not clip */
+		f.convertTo(f, CV_32F, 0.7, 0.15);
+	}
+
+	f = f.mul(gain);
+	rng.fill(n, RNG::NORMAL, Scalar(0), Scalar(params.noise));
+	f += n;
+	f.convertTo(tile, CV_16U, 65535.);
+}
+
+/**
+ * Writes all tiles as 16 bit PNG files to dir, and a project file that can be
+ * read by ScanSet::loadInput. Each image entry carries an extra "truth" node
+ * with its true position, which loadInput ignores.
+ */
+bool SynthScan::writeProject(const std::string& dir, const std::string& project) const
+{
+	int n = params.gridWidth * params.gridHeight;
+	std::atomic<bool> ok(true);
+
+	defaultExecutor().parallelFor(0, n, [&](int i) {
+		char name[64];
+		Mat tile;
+		int x = i % params.gridWidth, y = i / params.gridWidth;
+		snprintf(name, sizeof name, "/tile_%04i_%04i.png", x, y);
+		renderTile(x, y, tile);
+		if (!imwrite(dir + name, tile)) {
+			fprintf(stderr, "could not write \"%s%s\"\n", dir.c_str(), name);
+			ok = false;
+		}
+	});
+	if (!ok)
+		return false;
+
+	FileStorage fs(project, FileStorage::WRITE);
+	if (!fs.isOpened())
+		return false;
+	fs << "synth" << "{";
+	fs << "grid" << "[:" << params.gridWidth << params.gridHeight << "]";
+	fs << "tile" << "[:" << params.tileSize.width << params.tileSize.height << "]";
+	fs << "step" << "[:" << params.step.x << params.step.y << "]";
+	fs << "offset" << params.offset << "jitter" << params.jitter;
+	fs << "stageScale" << params.stageScale << "rotation" << params.rotation;
+	fs << "noise" << params.noise << "vignetting" << params.vignetting;
+	fs << "seed" << (double)params.seed;
+	fs << "}";
+	fs << "images" << "[";
+	for (int y = 0; y < params.gridHeight; y++) {
+		for (int x = 0; x < params.gridWidth; x++) {
+			char name[64];
+			Point2f s = stageAt(x, y);
+			Point2i t = truthAt(x, y);
+			snprintf(name, sizeof name, "/tile_%04i_%04i.png", x, y);
+			fs << "{";
+			fs << "path" << dir + name;
+			fs << "grid" << "[:" << x << y << "]";
+			fs << "stage" << "[:" << s.x << s.y << "]";
+			fs << "truth" << "[:" << t.x << t.y << "]";
+			fs << "}";
+		}
+	}
+	fs << "]";
+	return true;
+}
+
+bool loadSynthTruth(const std::string& project, int& gridWidth, int& gridHeight, std::vector<cv::Point2i>& truth)
+{
+	FileStorage fs(project, FileStorage::READ);
+	FileNode synth = fs["synth"], images = fs["images"];
+
+	if (!fs.isOpened() || synth.empty())
+		return false;
+	gridWidth  = (int)synth["grid"][0];
+	gridHeight = (int)synth["grid"][1];
+	truth.assign(gridWidth * gridHeight, Point2i(0, 0));
+	for (FileNodeIterator it = images.begin(); it != images.end(); ++it) {
+		FileNode g = (*it)["grid"], t = (*it)["truth"];
+		int x = (int)g[0], y = (int)g[1];
+		if (t.empty() || x < 0 || y < 0 || x >= gridWidth || y >= gridHeight)
+			return false;
+		truth[y * gridWidth + x] = Point2i((int)t[0], (int)t[1]);
+	}
+	return true;
+}
+
+static bool parsePair(const char* s, int& a, int& b)
+{
+	return sscanf(s, "%ix%i", &a, &b) == 2 && a > 0 && b > 0;
+}
+
+bool parseSynthArg(int argc, char** argv, int& i, SynthScanParams& params)
+{
+	std::string opt = argv[i];
+
+	if (i + 1 >= argc)
+		return false;
+	if (opt == "--grid")
+		return parsePair(argv[++i], params.gridWidth, params.gridHeight);
+	if (opt == "--tile")
+		return parsePair(argv[++i], params.tileSize.width, params.tileSize.height);
+	if (opt == "--step")
+		return parsePair(argv[++i], params.step.x, params.step.y);
+	if (opt == "--offset")
+		params.offset = atof(argv[++i]);
+	else if (opt == "--jitter")
+		params.jitter = atof(argv[++i]);
+	else if (opt == "--stage-scale")
+		params.stageScale = atof(argv[++i]);
+	else if (opt == "--rotation")
+		params.rotation = atof(argv[++i]);
+	else if (opt == "--noise")
+		params.noise = atof(argv[++i]);
+	else if (opt == "--vignetting")
+		params.vignetting = atof(argv[++i]);
+	else if (opt == "--seed")
+		params.seed = strtoull(argv[++i], nullptr, 10);
+	else if (opt == "--source")
+		params.source = argv[++i];
+	else
+		return false;
+	return true;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * Parameters of a synthetic scan. Distances are in pixels unless noted.
+ */
+struct SynthScanParams
+{
+	int         gridWidth = 10;
+	int         gridHeight = 10;
+	cv::Size    tileSize = cv::Size(640, 512);
+	cv::Point2i step = cv::Point2i(560, 448);  /* Nominal distance between tiles */
+	double      offset = 6.0;                  /* Max true deviation of a tile from the nominal grid */
+	double      jitter = 2.0;                  /* Std. dev. of the stage reading error */
+	double      stageScale = 0.5;              /* Stage units per pixel */
+	double      rotation = 0.3;                /* Stage to image rotation, degrees */
+	double      noise = 0.01;                  /* Std. dev. of pixel noise, fraction of full scale */
+	double      vignetting = 0.3;              /* Relative brightness loss in the tile corners */
+	uint64_t    seed = 1;
+	std::string source;                        /* Optional image to cut the tiles from */
+};
+
+/**
+ * Generates a tiled scan of a large scene with known tile positions.
+ *
+ * The scene is either a supplied image or a procedural texture that is
+ * evaluated per tile, so arbitrarily large grids never hold the whole scene
+ * in memory. Tiles are 16 bit single channel images.
+ */
+class SynthScan
+{
+public:
+	bool setup(const SynthScanParams& params);
+
+	void renderTile(int x, int y, cv::Mat& tile) const;
+	bool writeProject(const std::string& dir, const std::string& project) const;
+
+	/** True position of a tile in the scene */
+	cv::Point2i truthAt(int x, int y) const { return truth[y * params.gridWidth + x]; }
+	/** Position reported by the stage for a tile */
+	cv::Point2f stageAt(int x, int y) const { return stage[y * params.gridWidth + x]; }
+
+	const SynthScanParams& getParams() const { return params; }
+private:
+	SynthScanParams          params;
+	std::vector<cv::Point2i> truth;
+	std::vector<cv::Point2f> stage;
+	cv::Mat                  texture;   /* Periodic procedural texture, CV_32F */
+	cv::Mat                  scene;     /* Supplied scene, CV_32F */
+	cv::Mat                  gain;      /* Vignetting gain per tile pixel */
+};
+
+/**
+ * Reads the ground truth stored by SynthScan::writeProject, as a grid of
+ * positions in row-major order.
+ */
+bool loadSynthTruth(const std::string& project, int& gridWidth, int& gridHeight, std::vector<cv::Point2i>& truth);
+
+/**
+ * Parses one synthetic scan option at argv[i], advancing i past its value.
+ * @return false if argv[i] is not a synthetic scan option
+ */
+bool parseSynthArg(int argc, char** argv, int& i, SynthScanParams& params);
+
+#define SYNTH_USAGE \
+	"  --grid WxH          grid size (10x10)\n" \
+	"  --tile WxH          tile size (640x512)\n" \
+	"  --step XxY          nominal tile step (560x448)\n" \
+	"  --offset PX         max deviation of tiles from the grid (6)\n" \
+	"  --jitter PX         std. dev. of the stage error (2)\n" \
+	"  --stage-scale S     stage units per pixel (0.5)\n" \
+	"  --rotation DEG      stage rotation (0.3)\n" \
+	"  --noise F           pixel noise, fraction of full scale (0.01)\n" \
+	"  --vignetting F      brightness loss in the corners (0.3)\n" \
+	"  --seed N            random seed (1)\n" \
+	"  --source PATH       cut tiles from this image instead of a procedural texture\n"
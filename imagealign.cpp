@@ -1,7 +1,19 @@
 #include "pch.h"
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
-#include <omp.h>
+#include "stitch.h"
+#include "Executor.h"
+#include "ScratchArena.h"
+#include "EdgeMap.h"
+#include "Trace.h"
+#include <algorithm>
+#include <vector>
+
+/* Fewest candidates worth handing to another thread */
+#define SEARCH_MIN_CHUNK (16)
+
+#define SPARSE_CELL        (8)    /* One sample per square of this size, see findBestSparseOverlap */
+#define SPARSE_MIN_SAMPLES (16)   /* Offsets overlapping fewer samples score 0 */
 
 using namespace cv;
 
@@ -20,12 +32,16 @@ static Point2i clampRect(Rect2i& r, Point2i p)
     return pointCoordMax(r.tl(), pointCoordMin(r.br(), p));
 }
 
-bool getOverlapRoi(Mat& imageA, Mat& imageB, Point2i dr, Mat& roiA, Mat&roiB) {
+/**
+ * Computes the parts of two images of sizes sizeA and sizeB that overlap when
+ * B is placed at dr relative to A.
+ * @return false if they do not overlap
+ */
+static bool overlapRects(Size sizeA, Size sizeB, Point2i dr, Rect2i& roi_a, Rect2i& roi_b) {
     Point2i start_a, start_b, end_a, end_b;
     Point2i zero(0, 0);
-    Rect2i  bounds_a(0, 0, imageA.cols, imageA.rows);
-    Rect2i  bounds_b(0, 0, imageB.cols, imageB.rows);
-    Rect2i  roi_a, roi_b;
+    Rect2i  bounds_a(Point2i(0, 0), sizeA);
+    Rect2i  bounds_b(Point2i(0, 0), sizeB);
 
     start_a = pointCoordMax(dr, zero);
     start_b = pointCoordMax(-dr, zero);
@@ -37,6 +53,14 @@ bool getOverlapRoi(Mat& imageA, Mat& imageB, Point2i dr, Mat& roiA, Mat&roiB) {
     /* Sanity check */
     if (roi_a.size() != roi_b.size() || roi_a.width == 0 || roi_a.height == 0)
         return false;
+    return true;
+}
+
+bool getOverlapRoi(Mat& imageA, Mat& imageB, Point2i dr, Mat& roiA, Mat&roiB) {
+    Rect2i  roi_a, roi_b;
+
+    if (!overlapRects(imageA.size(), imageB.size(), dr, roi_a, roi_b))
+        return false;
 
     roiA = imageA(roi_a);
     roiB = imageB(roi_b);
@@ -46,14 +70,18 @@ bool getOverlapRoi(Mat& imageA, Mat& imageB, Point2i dr, Mat& roiA, Mat&roiB) {
 }
 
 float scoreOverlap(Mat& imageA, Mat& imageB, Point2i dr) {
-    Mat     diff_roi, roiA, roiB;
-    Scalar  norm;
+    Rect2i  roi_a, roi_b;
     double  norm_f;
 
     /* Sanity check */
-    if ( !getOverlapRoi( imageA, imageB, dr, roiA, roiB ) )
+    if (!overlapRects(imageA.size(), imageB.size(), dr, roi_a, roi_b))
         return 1e29;
 
+    /* Headers that do not own their data, so scoring a candidate does not
+     * touch the reference counts the other threads of a search share */
+    Mat roiA(roi_a.size(), imageA.type(), imageA.ptr(roi_a.y, roi_a.x), imageA.step);
+    Mat roiB(roi_b.size(), imageB.type(), imageB.ptr(roi_b.y, roi_b.x), imageB.step);
+
     /* Compute square difference */
    // absdiff(imageA(roi_a), imageB(roi_b), diff_roi);
    // diff_roi.mul(diff_roi);
@@ -69,6 +97,100 @@ float scoreOverlap(Mat& imageA, Mat& imageB, Point2i dr) {
 
 }
 
+/**
+ * Scores the candidates [begin, end) of a search, numbered with dy changing
+ * fastest, and keeps the first best one.
+ */
+template<typename Score>
+static void searchCandidates(const Score& score, Point2i first, int ny, int decimate, int begin, int end, float& best_score, Point2i& dr)
+{
+    for (int i = begin; i < end; i++) {
+        Point2i pos = first + Point2i(i / ny, i % ny) * decimate;
+        float s = score(pos / decimate);
+        if (s > best_score) {
+            best_score = s;
+            dr = pos;
+        }
+    }
+}
+
+/**
+ * Scores every decimate'th offset within range of guess with score(offset /
+ * decimate) and returns the best score.
+ *
+ * With idle threads around, which is the case when there are fewer pairs
+ * than cores, the candidates are split into chunks. Keeping the first best
+ * of each chunk and the first best chunk gives the same result as searching
+ * in order.
+ */
+template<typename Score>
+static float searchRange(const Score& score, Point2i guess, Point2i range, int decimate, Executor* executor, int spare,
+                         Point2i& dr, int* evaluations)
+{
+    float best_score = 0;
+    int nx = std::max(0, 2 * range.x / decimate + 1);
+    int ny = std::max(0, 2 * range.y / decimate + 1);
+    int n = nx * ny;
+    Point2i first = guess - range;
+    int chunks = std::min(spare + 1, n / SEARCH_MIN_CHUNK);
+
+    if (chunks <= 1) {
+        searchCandidates(score, first, ny, decimate, 0, n, best_score, dr);
+    }
+    else {
+        std::vector<float> scores(chunks, 0.f);
+        std::vector<Point2i> found(chunks);
+        executor->parallelFor(0, chunks, [&](int c) {
+            searchCandidates(score, first, ny, decimate, (int)((int64_t)n * c / chunks), (int)((int64_t)n * (c + 1) / chunks), scores[c], found[c]);
+        });
+        for (int c = 0; c < chunks; c++) {
+            if (scores[c] > best_score) {
+                best_score = scores[c];
+                dr = found[c];
+            }
+        }
+    }
+
+    if (evaluations)
+        *evaluations = n;
+    return best_score;
+}
+
+static int levelOf(int decimate)
+{
+    int level = 0;
+
+    while ((2 << level) <= decimate && level < OVERLAP_MAX_LEVELS - 1)
+        level++;
+    return level;
+}
+
+/**
+ * Resamples both images of a pair by 1 / decimate into the scratch buffers,
+ * on two threads if there are spare ones. At full resolution the images are
+ * used as they are.
+ */
+static void resamplePair(Mat& imageA, Mat& imageB, int decimate, Executor* executor, int spare,
+                         ScratchMat& scratch_a, ScratchMat& scratch_b, Mat& sc_a, Mat& sc_b)
+{
+    if (decimate == 1) {
+        sc_a = imageA;
+        sc_b = imageB;
+        return;
+    }
+    if (spare > 0) {
+        executor->parallelFor(0, 2, [&](int i) {
+            cv::resize( i ? imageB : imageA, i ? scratch_b.mat() : scratch_a.mat(), Size(), 1. / decimate, 1. / decimate, INTER_LINEAR );
+        });
+    }
+    else {
+        cv::resize( imageA, scratch_a.mat(), Size(), 1. / decimate, 1. / decimate, INTER_LINEAR );
+        cv::resize( imageB, scratch_b.mat(), Size(), 1. / decimate, 1. / decimate, INTER_LINEAR );
+    }
+    sc_a = scratch_a.mat();
+    sc_b = scratch_b.mat();
+}
+
 /**
  * Finds the displacement best fitting two overlapping images together.
  * 
@@ -78,28 +200,237 @@ float scoreOverlap(Mat& imageA, Mat& imageB, Point2i dr) {
  * @param range      Amount of pixels to deviate from the starting point
  * @param decimate   Factor by which to decimate the image before searching
  * @param dr         Displacement giving the best overlap
+ * @param evaluations If not null, receives the number of offsets scored
+ * @param executor   If not null, idle threads of it help with this search
  */
-float findBestOverlap(Mat& imageA, Mat& imageB, Point2i guess, Point2i range, int decimate, Point2i &dr) {
+float findBestOverlap(Mat& imageA, Mat& imageB, Point2i guess, Point2i range, int decimate, Point2i &dr, int* evaluations, Executor* executor) {
     Mat sc_a, sc_b;
-    float best_score = 0, score;
-    Point2i pos;
+    int level = levelOf(decimate);
+    int spare = executor ? executor->idleThreads() : 0;
 
-    /* Resample image to reduce workload */
-    cv::resize( imageA, sc_a, Size(), 1. / decimate, 1. / decimate, INTER_LINEAR );
-    cv::resize( imageB, sc_b, Size(), 1. / decimate, 1. / decimate, INTER_LINEAR );
+    /* Resample image to reduce workload, into buffers kept per thread and
+     * pyramid level so they are only allocated for the first pair */
+    ScratchMat scratch_a(SCRATCH_SEARCH + 2 * level), scratch_b(SCRATCH_SEARCH + 2 * level + 1);
+    resamplePair(imageA, imageB, decimate, executor, spare, scratch_a, scratch_b, sc_a, sc_b);
 
     /* Search through range */
-    for (int dx = guess.x - range.x; dx <= guess.x + range.x; dx+=decimate)
-        for (int dy = guess.y - range.y; dy <= guess.y + range.y; dy+=decimate) {
-            pos = Point2i(dx, dy);
-            score = scoreOverlap(sc_a, sc_b, pos / decimate);
-            if (score > best_score) {
-                best_score = score;
-                dr = pos;
+    return searchRange([&](Point2i p) { return scoreOverlap(sc_a, sc_b, p); },
+                       guess, range, decimate, executor, spare, dr, evaluations);
+}
+
+/**
+ * Same as findBestOverlap, but compares binarised edge maps of the images
+ * (see EdgeMap) instead of their intensities. Insensitive to brightness
+ * differences between tiles and much less data to go through per offset.
+ * Images can be of any single channel type.
+ */
+float findBestEdgeOverlap(Mat& imageA, Mat& imageB, Point2i guess, Point2i range, int decimate, Point2i& dr, int* evaluations, Executor* executor) {
+    Mat sc_a, sc_b;
+    EdgeMap edge_a, edge_b;
+    int level = levelOf(decimate);
+    int spare = executor ? executor->idleThreads() : 0;
+
+    ScratchMat scratch_a(SCRATCH_SEARCH + 2 * level), scratch_b(SCRATCH_SEARCH + 2 * level + 1);
+    ScratchMat grad_a(SCRATCH_GRADIENT + 2 * level), grad_b(SCRATCH_GRADIENT + 2 * level + 1);
+    ScratchMat bits_a(SCRATCH_EDGES + 2 * level), bits_b(SCRATCH_EDGES + 2 * level + 1);
+    resamplePair(imageA, imageB, decimate, executor, spare, scratch_a, scratch_b, sc_a, sc_b);
+    if (!edge_a.build(sc_a, grad_a.mat(), bits_a.mat()) || !edge_b.build(sc_b, grad_b.mat(), bits_b.mat()))
+        return 0;
+
+    return searchRange([&](Point2i p) { return scoreEdgeOverlap(edge_a, edge_b, p); },
+                       guess, range, decimate, executor, spare, dr, evaluations);
+}
+
+static float pixelAt(const Mat& image, int x, int y)
+{
+    switch (image.depth()) {
+    case CV_8U:  return image.ptr<uint8_t>(y)[x];
+    case CV_8S:  return image.ptr<int8_t>(y)[x];
+    case CV_16U: return image.ptr<uint16_t>(y)[x];
+    case CV_16S: return image.ptr<int16_t>(y)[x];
+    case CV_32S: return (float)image.ptr<int32_t>(y)[x];
+    case CV_32F: return image.ptr<float>(y)[x];
+    case CV_64F: return (float)image.ptr<double>(y)[x];
+    default: {
+        /* Half floats, which have no C++ type to read them as */
+        Mat v;
+        image(Rect(x, y, 1, 1)).convertTo(v, CV_32F);
+        return v.at<float>(0, 0);
+    }
+    }
+}
+
+/**
+ * Picks the pixel with the strongest gradient of every SPARSE_CELL square of
+ * region of image as a sample, skipping flat squares. Samples are (x, y,
+ * value) rows of samples (CV_32FC3), in coordinates of the whole image.
+ * @return the number of samples
+ */
+static int pickSamples(const Mat& image, Rect region, Mat& gradient, Mat& samples)
+{
+    Mat roi = image(region);
+    int cols = (roi.cols + SPARSE_CELL - 1) / SPARSE_CELL;
+    int rows = (roi.rows + SPARSE_CELL - 1) / SPARSE_CELL;
+    int n = 0;
+
+    if (gradientMagnitude(roi, gradient) < 0)
+        return 0;
+    samples.create(std::max(1, cols * rows), 1, CV_32FC3);
+    for (int cy = 0; cy < rows; cy++) {
+        for (int cx = 0; cx < cols; cx++) {
+            float best = 0;
+            int bx = 0, by = 0;
+            for (int y = cy * SPARSE_CELL; y < std::min(roi.rows, (cy + 1) * SPARSE_CELL); y++) {
+                const float* g = gradient.ptr<float>(y);
+                for (int x = cx * SPARSE_CELL; x < std::min(roi.cols, (cx + 1) * SPARSE_CELL); x++) {
+                    if (g[x] > best) {
+                        best = g[x];
+                        bx = x;
+                        by = y;
+                    }
+                }
             }
+            if (best > 0)
+                samples.at<Vec3f>(n++) = Vec3f((float)(region.x + bx), (float)(region.y + by), pixelAt(roi, bx, by));
         }
+    }
+    return n;
+}
 
-    return best_score;
+/**
+ * Size of an image of size after resamplePair with decimate.
+ */
+static Size levelSize(Size size, int decimate)
+{
+    if (decimate == 1)
+        return size;
+    return Size(saturate_cast<int>(size.width * (1. / decimate)), saturate_cast<int>(size.height * (1. / decimate)));
+}
+
+/**
+ * Part of A, at 1 / decimate, that B overlaps at any offset of the search.
+ * One pixel wider on each side for the rounding of pos / decimate.
+ */
+static Rect searchRegion(Size sizeA, Size sizeB, Point2i guess, Point2i range, int decimate)
+{
+    Point2i lo = (guess - range) / decimate - Point2i(1, 1);
+    Point2i hi = (guess + range) / decimate + Point2i(1, 1);
+
+    return Rect(lo, hi + Point2i(sizeB)) & Rect(Point2i(0, 0), sizeA);
+}
+
+/**
+ * scoreOverlap on the samples of A that fall inside B at displacement dr,
+ * with the number of samples in place of the overlap area.
+ */
+template<typename T>
+static float scoreSamples(const Vec3f* samples, int n, const Mat& b, Point2i dr)
+{
+    double sum = 0;
+    int used = 0;
+
+    for (int i = 0; i < n; i++) {
+        int x = (int)samples[i][0] - dr.x, y = (int)samples[i][1] - dr.y;
+        if ((unsigned)x >= (unsigned)b.cols || (unsigned)y >= (unsigned)b.rows)
+            continue;
+        float d = samples[i][2] - (float)b.ptr<T>(y)[x];
+        sum += d * d;
+        used++;
+    }
+    if (used < SPARSE_MIN_SAMPLES)
+        return 0;
+    return (float)(used / pow(sum, 3.3 / 2));
+}
+
+template<typename T>
+static float searchSamples(const Vec3f* samples, int n, const Mat& b, Point2i guess, Point2i range, int decimate,
+                           Executor* executor, int spare, Point2i& dr, int* evaluations)
+{
+    return searchRange([&](Point2i p) { return scoreSamples<T>(samples, n, b, p); },
+                       guess, range, decimate, executor, spare, dr, evaluations);
+}
+
+/**
+ * Same as findBestOverlap, but scores each offset on a fixed set of samples
+ * of A instead of the whole overlap: the strongest gradient of every
+ * SPARSE_CELL square of the part of A that B can overlap. An offset then
+ * costs in proportion to the samples rather than the overlap area. Meant
+ * for the coarse levels, where only the neighbourhood of the best offset
+ * needs to be right.
+ *
+ * @param samplesA   If not null, samples of A picked by earlier searches,
+ *                   reused when they cover this search, which then skips
+ *                   resampling A as well. Samples picked here are added.
+ *                   Must only ever be handed A, and one search at a time.
+ */
+float findBestSparseOverlap(Mat& imageA, Mat& imageB, Point2i guess, Point2i range, int decimate, Point2i& dr, int* evaluations, Executor* executor,
+                            SparseSamples* samplesA) {
+    Mat sc_a, sc_b;
+    int level = levelOf(decimate);
+    int spare = executor ? executor->idleThreads() : 0;
+    Rect region = searchRegion(levelSize(imageA.size(), decimate), levelSize(imageB.size(), decimate), guess, range, decimate);
+    const Vec3f* s;
+    int n;
+
+    if (imageB.channels() != 1)
+        return 0;
+    if (samplesA && samplesA->source != imageA.size())
+        samplesA->clear();
+
+    ScratchMat scratch_a(SCRATCH_SEARCH + 2 * level), scratch_b(SCRATCH_SEARCH + 2 * level + 1);
+    ScratchMat grad_a(SCRATCH_GRADIENT + 2 * level);
+    ScratchMat samples(SCRATCH_SAMPLES + 2 * level), float_b(SCRATCH_SAMPLES + 2 * level + 1);
+    if (samplesA && !samplesA->region[level].empty() && (samplesA->region[level] & region) == region) {
+        /* A is only needed through its samples */
+        if (decimate == 1) {
+            sc_b = imageB;
+        }
+        else {
+            cv::resize(imageB, scratch_b.mat(), Size(), 1. / decimate, 1. / decimate, INTER_LINEAR);
+            sc_b = scratch_b.mat();
+        }
+        n = samplesA->samples[level].rows;
+        s = samplesA->samples[level].ptr<Vec3f>();
+    }
+    else {
+        resamplePair(imageA, imageB, decimate, executor, spare, scratch_a, scratch_b, sc_a, sc_b);
+
+        /* Pick over what earlier searches needed too, so none of them misses */
+        if (samplesA)
+            region |= samplesA->region[level];
+        n = region.empty() ? 0 : pickSamples(sc_a, region, grad_a.mat(), samples.mat());
+        s = samples.mat().ptr<Vec3f>();
+        if (samplesA) {
+            samplesA->source = imageA.size();
+            samplesA->region[level] = region;
+            samplesA->samples[level] = samples.mat().rowRange(0, n).clone();
+        }
+    }
+
+    /* Read B in its own type rather than converting it for every search */
+    switch (sc_b.depth()) {
+    case CV_8U:  return searchSamples<uint8_t>(s, n, sc_b, guess, range, decimate, executor, spare, dr, evaluations);
+    case CV_16U: return searchSamples<uint16_t>(s, n, sc_b, guess, range, decimate, executor, spare, dr, evaluations);
+    case CV_32F: return searchSamples<float>(s, n, sc_b, guess, range, decimate, executor, spare, dr, evaluations);
+    default:
+        sc_b.convertTo(float_b.mat(), CV_32F);
+        return searchSamples<float>(s, n, float_b.mat(), guess, range, decimate, executor, spare, dr, evaluations);
+    }
+}
+
+/**
+ * Searches one pyramid level the way engine does it.
+ */
+static float searchLevel(int engine, Mat& imageA, Mat& imageB, Point2i guess, Point2i range, int decimate, Point2i& dr,
+                         int* evaluations, Executor* executor, SparseSamples* samplesA)
+{
+    bool coarse = decimate > 1;
+
+    if (engine == OVERLAP_ENGINE_EDGE || (engine == OVERLAP_ENGINE_EDGE_SSD && coarse))
+        return findBestEdgeOverlap(imageA, imageB, guess, range, decimate, dr, evaluations, executor);
+    if (engine == OVERLAP_ENGINE_SPARSE && coarse)
+        return findBestSparseOverlap(imageA, imageB, guess, range, decimate, dr, evaluations, executor, samplesA);
+    return findBestOverlap(imageA, imageB, guess, range, decimate, dr, evaluations, executor);
 }
 
 /**
@@ -148,17 +479,35 @@ float iterBestOverlap(Mat& imageA, Mat& imageB, Point2i guess, Point2i range, in
  * @param range      Amount of pixels to deviate from the starting point
  * @param logd       log2 of the maximum decimation factor
  * @param dr         Displacement giving the best overlap
+ * @param stats      If not null, receives the search statistics
+ * @param executor   If not null, idle threads of it help with the search
+ */
+float iterBestOverlapNC(Mat& imageA, Mat& imageB, Point2i guess, Point2i range, int logd, Point2i& dr, OverlapStats* stats, Executor* executor) {
+    return iterBestOverlapEngine(imageA, imageB, guess, range, logd, dr, OVERLAP_ENGINE_SSD, stats, executor);
+}
+
+/**
+ * Coarse to fine search like iterBestOverlapNC, scoring each level the way
+ * engine (one of the OVERLAP_ENGINE_ values) does.
+ *
+ * @param samplesA   Sample cache of A for OVERLAP_ENGINE_SPARSE, see
+ *                   findBestSparseOverlap
  */
-float iterBestOverlapNC(Mat& imageA, Mat& imageB, Point2i guess, Point2i range, int logd, Point2i& dr) {
+float iterBestOverlapEngine(Mat& imageA, Mat& imageB, Point2i guess, Point2i range, int logd, Point2i& dr, int engine, OverlapStats* stats, Executor* executor,
+                            SparseSamples* samplesA) {
     float score;
     Point2i round_guess, round_range;
+    int evals;
 
     round_guess = guess;
     round_range = range;
     for (int sf = logd; sf >= 0; sf--) {
+        TraceSpan span("level_search", -1, -1, sf);
 
         /* Determine the best overlap vector */
-        score = findBestOverlap(imageA, imageB, round_guess, round_range, 1 << sf, dr);
+        score = searchLevel(engine, imageA, imageB, round_guess, round_range, 1 << sf, dr, stats ? &evals : nullptr, executor, samplesA);
+        if (stats && sf < OVERLAP_MAX_LEVELS)
+            stats->evaluations[sf] += evals;
 
         /* Search an area half as large around the result */
         round_guess = dr;
@@ -167,4 +516,16 @@ float iterBestOverlapNC(Mat& imageA, Mat& imageB, Point2i guess, Point2i range,
 
     return score;
 
-}
\ No newline at end of file
+}
+
+/**
+ * Coarse to fine search on edge maps (OVERLAP_ENGINE_EDGE).
+ *
+ * @param refine     Search the full resolution level with intensities
+ *                   instead (OVERLAP_ENGINE_EDGE_SSD), the returned score
+ *                   is then an SSD score
+ */
+float iterBestOverlapEdge(Mat& imageA, Mat& imageB, Point2i guess, Point2i range, int logd, Point2i& dr, bool refine, OverlapStats* stats, Executor* executor) {
+    return iterBestOverlapEngine(imageA, imageB, guess, range, logd, dr, refine ? OVERLAP_ENGINE_EDGE_SSD : OVERLAP_ENGINE_EDGE,
+                                 stats, executor);
+}
@@ -1,12 +1,14 @@
 #include "pch.h"
 #include "scanset.h"
 #include <set>
+#include <algorithm>
 #include "stitch.h"
+#include "OverlapCache.h"
+#include "Trace.h"
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 #include <stdio.h>
-#include <omp.h>
-#include <opencv2/highgui.hpp>
+#include <sys/stat.h>
 
 using namespace std;
 using namespace cv;
@@ -18,19 +20,161 @@ Point2i DISP_DIRECTIONS[4] = { Point2i(0,-1), Point2i(0,1), Point2i(-1,0), Point
  * @param path      The filesystem path to the image data.
  * @param gridPos   The position within the logical grid. These need to be exact (see generateGrid)
  * @param stagePos  The stage position this image was taken at, if no stage feedback is available, this can be set to gridPos.
+ *
+ * In live mode (see declareGrid) the image is placed directly into its grid slot.
  */
 void ScanSet::addImage(std::string path, cv::Point2i gridPos, cv::Point2f stagePos)
 {
 	ScanImage image;
 
-	assert( gridGenerated == false );
+	image.path = path;
+	insertImage(image, gridPos, stagePos);
+}
+
+/**
+ * Adds an image that is already in memory to the scan set. The Mat is moved
+ * into the set, so no pixels are copied.
+ * @param image     The image data, any depth supported by the solvers.
+ * @param gridPos   The position within the logical grid (see addImage)
+ * @param stagePos  The stage position this image was taken at (see addImage)
+ */
+void ScanSet::addImage(cv::Mat&& image, cv::Point2i gridPos, cv::Point2f stagePos)
+{
+	ScanImage si;
+
+	si.setMemoryImage(std::move(image), nullptr);
+	insertImage(si, gridPos, stagePos);
+}
+
+/**
+ * Adds a caller owned pixel buffer to the scan set without copying it. The
+ * buffer needs to stay valid until the set releases it, at which point
+ * release is called (if not NULL) with releaseArg and data.
+ * @param data      Pointer to the first pixel
+ * @param size      Image dimensions
+ * @param type      OpenCV type of the pixels (eg. CV_16UC1)
+ * @param step      Bytes per row, or 0 for tightly packed rows
+ * @param gridPos   The position within the logical grid (see addImage)
+ * @param stagePos  The stage position this image was taken at (see addImage)
+ */
+void ScanSet::addImage(void* data, cv::Size size, int type, size_t step, image_release_cb_t release, void* releaseArg,
+                       cv::Point2i gridPos, cv::Point2f stagePos)
+{
+	ScanImage si;
+	std::shared_ptr<void> owner(data, [release, releaseArg](void* p) {
+		if (release)
+			release(releaseArg, p);
+	});
+
+	si.setMemoryImage(Mat(size, type, data, step ? step : (size_t)Mat::AUTO_STEP), owner);
+	insertImage(si, gridPos, stagePos);
+}
 
-	image.path          = path;
-	image.stagePosition = stagePos;
-	image.gridPosition  = gridPos;
+void ScanSet::insertImage(ScanImage& image, cv::Point2i gridPos, cv::Point2f stagePos)
+{
+	image.setMetrics(metrics);
+	image.setColor(color, alignChannel);
+	image.setFlatField(flatField);
+	if (liveGrid) {
+		int ii = tileIndex(gridSlot(gridPos));
+		assert((tileFlags[ii] & TILE_PRESENT) == 0);
+		m_Images[ii]       = std::move(image);
+		gridPositions[ii]  = gridPos;
+		stagePositions[ii] = stagePos;
+		tileFlags[ii]     |= TILE_PRESENT;
+		return;
+	}
+
+	assert( gridGenerated == false );
 
 	/* Add the image to our imagelist */
-	m_Images.push_back(image);
+	m_Images.push_back(std::move(image));
+	gridPositions.push_back(gridPos);
+	stagePositions.push_back(stagePos);
+	stitchPositions.push_back(Point2i(0, 0));
+	for (int d = 0; d < 4; d++) {
+		displacements[d].push_back(Point2i(0, 0));
+		pairScores[d].push_back(NAN);
+	}
+	tileFlags.push_back(TILE_PRESENT);
+}
+
+/**
+ * Declares the grid geometry up front for live acquisition, where images are
+ * added one by one as they are acquired instead of all before generateGrid.
+ *
+ * @param gridOrigin   The gridPosition of the top left tile
+ * @param gridStep     The gridPosition increment between neighbouring tiles
+ * @param width        Number of columns in the grid
+ * @param height       Number of rows in the grid
+ * @param stageOrigin  The stage position of the top left tile
+ */
+void ScanSet::declareGrid(cv::Point2i gridOrigin, cv::Point2i gridStep, int width, int height, cv::Point2f stageOrigin)
+{
+	int n = width * height;
+
+	assert(gridGenerated == false && m_Images.empty());
+
+	gridWidth      = width;
+	gridHeight     = height;
+	liveGridOrigin = gridOrigin;
+	liveGridStep   = gridStep;
+	this->stageOrigin = stageOrigin;
+
+	m_Images.resize(n);
+	gridPositions.resize(n);
+	stagePositions.resize(n);
+	stitchPositions.assign(n, Point2i(0, 0));
+	for (int d = 0; d < 4; d++) {
+		displacements[d].assign(n, Point2i(0, 0));
+		pairScores[d].assign(n, NAN);
+	}
+	tileFlags.assign(n, 0);
+
+	liveGrid = true;
+	gridGenerated = true;
+}
+
+/**
+ * Maps a gridPosition to its (x,y) slot in a declared grid.
+ */
+cv::Point2i ScanSet::gridSlot(cv::Point2i gridPos) const
+{
+	Point2i d = gridPos - liveGridOrigin;
+	assert(liveGrid);
+	assert(d.x % liveGridStep.x == 0 && d.y % liveGridStep.y == 0);
+	return Point2i(d.x / liveGridStep.x, d.y / liveGridStep.y);
+}
+
+/**
+ * Stores a measured displacement from tile g to its dir neighbour, along with
+ * the inverse displacement on the neighbour, and marks both as valid.
+ * @param score  Match score of the measurement, NAN if not known
+ */
+void ScanSet::setDisplacement(cv::Point2i g, int dir, cv::Point2i dr, float score)
+{
+	static const int opposite[4] = { DISP_DOWN, DISP_UP, DISP_RIGHT, DISP_LEFT };
+	int ia = tileIndex(g);
+	int ib = tileIndex(g + DISP_DIRECTIONS[dir]);
+
+	displacements[dir][ia] = dr;
+	displacements[opposite[dir]][ib] = -dr;
+	pairScores[dir][ia] = score;
+	pairScores[opposite[dir]][ib] = score;
+	tileFlags[ia] |= TILE_DISP_VALID(dir);
+	tileFlags[ib] |= TILE_DISP_VALID(opposite[dir]);
+}
+
+/**
+ * Reorders a per-tile array so that element perm[i] ends up at index i.
+ */
+template<typename T> static void permuteTiles(std::vector<T>& v, const std::vector<int>& perm)
+{
+	std::vector<T> out;
+	out.reserve(v.size());
+	for (int i : perm)
+		out.push_back(std::move(v[i]));
+	v.swap(out);
 }
 
 static int findIndexInSet( set<int> &s, int value) {
@@ -51,51 +195,86 @@ static int findIndexInSet( set<int> &s, int value) {
  * should have the EXACT same value for the corresponding gridPosition axis.
  * 
  * When this function has been run, it is no longer possible to add new images.
+ *
+ * @return false if the positions do not fill a regular grid exactly once,
+ *         the set is then left unchanged
  */
-void ScanSet::generateGrid()
+bool ScanSet::generateGrid()
 {
 	Point2i g_min, g_max, g_size, g_step;
 	set<int> x_pos, y_pos;
-	int xi = -1, yi = -1;
+	std::vector<int> perm;
+	int xi = -1, yi = -1, width, height;
+
+	if (m_Images.empty())
+		return false;
 
 	/* Build sorted list of unique grid coordinates*/
-	for (ScanImage& img : m_Images) {
-		x_pos.insert(img.gridPosition.x);
-		y_pos.insert(img.gridPosition.y);
+	for (Point2i& gp : gridPositions) {
+		x_pos.insert(gp.x);
+		y_pos.insert(gp.y);
 	}
 
 	/* Find the extents and of that grid */
 	g_min  = Point2i(*x_pos.cbegin(), *y_pos.cbegin());
 	g_max  = Point2i(*x_pos.crbegin(), *y_pos.crbegin());
 	g_size = g_max - g_min;
-	g_step = Point2i(*++x_pos.cbegin(), *++y_pos.cbegin()) - g_min;
-	gridWidth  = g_size.x / g_step.x + 1;
-	gridHeight = g_size.y / g_step.y + 1;
-
-	assert(g_size.x / g_step.x == x_pos.size() - 1);
-	assert(g_size.y / g_step.y == y_pos.size() - 1);
-	
-	/* Create the image position map */
-	idxGrid.create(gridHeight, gridWidth, CV_32S);
+	g_step.x = x_pos.size() > 1 ? *++x_pos.cbegin() - g_min.x : 1;
+	g_step.y = y_pos.size() > 1 ? *++y_pos.cbegin() - g_min.y : 1;
+	width  = g_size.x / g_step.x + 1;
+	height = g_size.y / g_step.y + 1;
+
+	/* Irregular steps or missing tiles would leave slots empty */
+	if (width != (int)x_pos.size() || height != (int)y_pos.size() ||
+	    width * height != (int)m_Images.size())
+		return false;
+
+	/* Find the grid slot of every image */
+	perm.assign(width * height, -1);
 	for (int ii = 0; ii < m_Images.size(); ii++ ) {
-		ScanImage& img = m_Images[ii];
+		Point2i& gp = gridPositions[ii];
 
 		/* Find the index of that position in our list */
-		xi = findIndexInSet(x_pos, (int) img.gridPosition.x);
-		yi = findIndexInSet(y_pos, (int) img.gridPosition.y);
-		assert( xi != -1 && yi != -1 );
+		xi = findIndexInSet(x_pos, (int) gp.x);
+		yi = findIndexInSet(y_pos, (int) gp.y);
+		if (xi == -1 || yi == -1 || perm[yi * width + xi] != -1)
+			return false;
 
-		idxGrid.at<int>(yi, xi) = ii;
+		perm[yi * width + xi] = ii;
+	}
+	gridWidth  = width;
+	gridHeight = height;
+
+	/* Move the tile data into row-major grid order */
+	permuteTiles(m_Images, perm);
+	permuteTiles(gridPositions, perm);
+	permuteTiles(stagePositions, perm);
+	permuteTiles(stitchPositions, perm);
+	for (int d = 0; d < 4; d++) {
+		permuteTiles(displacements[d], perm);
+		permuteTiles(pairScores[d], perm);
 	}
+	permuteTiles(tileFlags, perm);
 
 	/* Mark that we are done */
 	gridGenerated = true;
 
-	stageOrigin = imageAt(0, 0).stagePosition;
+	stageOrigin = stagePositionAt(0, 0);
+	return true;
 }
 
-void ScanSet::saveProject(std::string path, int flags)
+/**
+ * Writes the tile list and the parts of the solution selected by flags
+ * (SAVE_FLAG_) in the format loadInput reads.
+ * @return false, without writing anything, if a tile was added from memory
+ *         (see addImage) and so has no path to be loaded again from
+ */
+bool ScanSet::saveProject(std::string path, int flags)
 {
+	for (size_t ii = 0; ii < m_Images.size(); ii++)
+		if ((tileFlags[ii] & TILE_PRESENT) && m_Images[ii].isMemoryBacked())
+			return false;
+
 	cv::FileStorage fs(path, cv::FileStorage::WRITE);
 	if (flags & SAVE_FLAG_MATRIX) {
 		fs << "stageToImgX" << stageToImgX;
@@ -111,23 +290,26 @@ void ScanSet::saveProject(std::string path, int flags)
 		fs << "stitchRect" << stitchRect;
 	
 	fs << "images" << "[";
-	for (ScanImage& si : m_Images) {
+	for (int ii = 0; ii < m_Images.size(); ii++) {
+		if (!(tileFlags[ii] & TILE_PRESENT))
+			continue;
 		fs << "{:";
-		fs << "path" << si.path;
-		fs << "grid"   << si.gridPosition;
-		fs << "stage"  << si.stagePosition;
+		fs << "path" << m_Images[ii].path;
+		fs << "grid"   << gridPositions[ii];
+		fs << "stage"  << stagePositions[ii];
 		if ( flags & SAVE_FLAG_SOLVER_OPT )
-			fs << "stitch" << si.stitchPosition;
+			fs << "stitch" << stitchPositions[ii];
 		if (flags & SAVE_FLAG_DISPLACEMENTS) {
 			std::vector<Point2i> disps;
 			for (int i = 0; i < 4; i++)
-				disps.push_back(si.displacements[i]);
+				disps.push_back(displacements[i][ii]);
 			fs << "displacements" << disps;
 		}
 		fs << "}";
 	}
 	fs << "]";
 	fs.release();
+	return true;
 }
 
 void ScanSet::loadInput(std::string path)
@@ -157,9 +339,9 @@ void ScanSet::saveOverlaps(std::string path)
 	Mat dispMap(3, sizes, CV_32SC2);
 	for (int x = 0; x < gridWidth; x++) {
 		for (int y = 0; y < gridHeight; y++) {
-			ScanImage& si = imageAt(x, y);
+			int ii = tileIndex(x, y);
 			for (int d = 0; d < 4; d++)
-				dispMap.at<Point2i>(x, y, d) = si.displacements[d];
+				dispMap.at<Point2i>(x, y, d) = displacements[d][ii];
 		}
 	}
 	cv::FileStorage fs(path, cv::FileStorage::WRITE);
@@ -174,28 +356,254 @@ void ScanSet::loadOverlaps(std::string path)
 	fs["displacements"] >> dispMap;
 	for (int x = 0; x < gridWidth; x++) {
 		for (int y = 0; y < gridHeight; y++) {
-			ScanImage& si = imageAt(x, y);
-			for (int d = 0; d < 4; d++)
-				si.displacements[d] = dispMap.at<Point2i>(x, y, d);
+			int ii = tileIndex(x, y);
+			for (int d = 0; d < 4; d++) {
+				displacements[d][ii] = dispMap.at<Point2i>(x, y, d);
+				if (hasImageAt(Point2i(x, y), d))
+					tileFlags[ii] |= TILE_DISP_VALID(d);
+			}
+		}
+	}
+}
+
+/**
+ * Splits the grid into shardsX by shardsY blocks of (nearly) equal size.
+ * @return the block of shard index, counted row by row
+ */
+cv::Rect ScanSet::shardBlock(int index, int shardsX, int shardsY) const
+{
+	int sx = index % shardsX, sy = index / shardsX;
+	int x0 = gridWidth * sx / shardsX, x1 = gridWidth * (sx + 1) / shardsX;
+	int y0 = gridHeight * sy / shardsY, y1 = gridHeight * (sy + 1) / shardsY;
+	return Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+/**
+ * Writes the pairs owned by block (see PairOverlapSolver::computeOverlapsShard)
+ * that have a displacement, for mergeOverlapShards.
+ */
+void ScanSet::saveOverlapShard(std::string path, cv::Rect block)
+{
+	std::vector<Vec<int, 5>> pairs;
+	std::vector<float> scores;
+
+	block &= Rect(0, 0, gridWidth, gridHeight);
+	for (int y = block.y; y < block.y + block.height; y++) {
+		for (int x = block.x; x < block.x + block.width; x++) {
+			for (int d : { DISP_DOWN, DISP_RIGHT }) {
+				Point2i g(x, y);
+				if (!hasDisplacement(g, d) || std::isnan(pairScoreAt(g, d)))
+					continue;
+				Point2i dr = displacementAt(g, d);
+				pairs.push_back(Vec<int, 5>(x, y, d, dr.x, dr.y));
+				scores.push_back(pairScoreAt(g, d));
+			}
+		}
+	}
+	cv::FileStorage fs(path, cv::FileStorage::WRITE);
+	fs << "gridWidth"  << gridWidth;
+	fs << "gridHeight" << gridHeight;
+	fs << "block"      << block;
+	fs << "pairs"      << Mat((int)pairs.size(), 5, CV_32S, pairs.data());
+	fs << "scores"     << Mat(scores, false);
+}
+
+/**
+ * Combines the partial overlap files written by saveOverlapShard.
+ *
+ * The result does not depend on the order of paths: files are applied in
+ * block order and when blocks overlap, the pair from the first block wins.
+ * @return the number of pairs merged, or -1 if a file could not be read or
+ *         belongs to a grid of another size
+ */
+int ScanSet::mergeOverlapShards(const std::vector<std::string>& paths)
+{
+	struct Shard {
+		Rect  block;
+		Mat   pairs;
+		Mat   scores;
+	};
+	std::vector<Shard> shards;
+	std::vector<uint8_t> merged(tileFlags.size(), 0);
+	int count = 0;
+
+	for (const std::string& path : paths) {
+		cv::FileStorage fs(path, cv::FileStorage::READ);
+		Shard s;
+		if (!fs.isOpened() || (int)fs["gridWidth"] != gridWidth || (int)fs["gridHeight"] != gridHeight)
+			return -1;
+		fs["block"]  >> s.block;
+		fs["pairs"]  >> s.pairs;
+		fs["scores"] >> s.scores;
+		if ((size_t)s.pairs.rows != s.scores.total() || (!s.pairs.empty() && s.pairs.cols != 5))
+			return -1;
+		shards.push_back(s);
+	}
+	std::stable_sort(shards.begin(), shards.end(), [](const Shard& a, const Shard& b) {
+		return a.block.y != b.block.y ? a.block.y < b.block.y : a.block.x < b.block.x;
+	});
+
+	for (Shard& s : shards) {
+		for (int i = 0; i < s.pairs.rows; i++) {
+			const int* p = s.pairs.ptr<int>(i);
+			Point2i g(p[0], p[1]);
+			int d = p[2];
+			if (d != DISP_DOWN && d != DISP_RIGHT)
+				continue;
+			if (g.x < 0 || g.y < 0 || g.x >= gridWidth || g.y >= gridHeight || !hasImageAt(g, d))
+				continue;
+			uint8_t& done = merged[tileIndex(g)];
+			if (done & TILE_DISP_VALID(d))
+				continue;
+			done |= TILE_DISP_VALID(d);
+			setDisplacement(g, d, Point2i(p[3], p[4]), s.scores.at<float>(i));
+			count++;
 		}
 	}
+	return count;
 }
 
 void ScanSet::evictAllF32()
 {
-	for (int x = 0; x < gridWidth; x++)
-		for (int y = 0; y < gridHeight; y++)
-			imageAt(x,y).evictImageF32();
+	for (ScanImage& img : m_Images)
+		img.evictImageF32();
 }
 
-bool ScanImage::getImage(cv::Mat& image)
+/**
+ * Attaches a metrics collector that tile loading reports to, or detaches it
+ * when metrics is null.
+ */
+void ScanSet::setMetrics(Metrics* metrics)
+{
+	this->metrics = metrics;
+	for (ScanImage& img : m_Images)
+		img.setMetrics(metrics);
+}
+
+/**
+ * Makes colour tiles load with all their channels (and all tiles added later,
+ * see ScanImage::setColor). Tiles that were already loaded are dropped so
+ * they are decoded again in the new mode.
+ * @param alignChannel  Channel the overlaps are measured on, or CHANNEL_LUMA
+ */
+void ScanSet::setColor(bool color, int alignChannel)
+{
+	this->color = color;
+	this->alignChannel = alignChannel;
+	for (ScanImage& img : m_Images)
+		img.setColor(color, alignChannel);
+}
+
+/**
+ * Selects whether the tile is decoded in colour, and which plane of a colour
+ * tile getImage returns: a single channel (in the order OpenCV stores them,
+ * BGR) or the luminance when alignChannel is CHANNEL_LUMA.
+ */
+void ScanImage::setColor(bool color, int alignChannel)
+{
+	if (color != this->color) {
+		evictImage();
+		contentChanged();
+	}
+	this->color = color;
+	if (alignChannel != this->alignChannel) {
+		cachedPlane.release();
+		evictImageF32();
+		contentChanged();
+	}
+	this->alignChannel = alignChannel;
+}
+
+/**
+ * Sets the flat-field and dark-frame correction for every tile, including
+ * tiles added later. Loaded tiles are dropped so they get corrected too.
+ * Passing two empty images turns the correction off.
+ * @param flat  Image of an empty, evenly lit field (may be empty)
+ * @param dark  Image taken with the light blocked (may be empty)
+ * @return false if the references do not match each other
+ */
+bool ScanSet::setFlatField(const cv::Mat& flat, const cv::Mat& dark)
+{
+	std::shared_ptr<FlatField> ff = std::make_shared<FlatField>();
+
+	if (!ff->setup(flat, dark))
+		return false;
+	flatField = ff->empty() ? nullptr : ff;
+	for (ScanImage& img : m_Images)
+		img.setFlatField(flatField);
+	return true;
+}
+
+void ScanImage::setFlatField(std::shared_ptr<const FlatField> flatField)
+{
+	if (flatField == this->flatField)
+		return;
+	evictImage();
+	this->flatField = flatField;
+	contentChanged();
+}
+
+bool ScanImage::loadImage()
 {
+	int64_t t0;
+	struct stat st;
+
 	if (!cached) {
-		cachedImage = imread(String(path.c_str()), IMREAD_ANYDEPTH);
+		TraceSpan span("tile_load");
+		t0 = metrics ? Metrics::now() : 0;
+		cachedImage = imread(String(path.c_str()), color ? IMREAD_ANYDEPTH | IMREAD_ANYCOLOR : IMREAD_ANYDEPTH);
 		if (cachedImage.data == nullptr)
 			return false;
-		cached = true;
+		cached    = true;
+		corrected = false;
+		if (metrics) {
+			metrics->record(HIST_DECODE_US, Metrics::now() - t0);
+			metrics->add(METRIC_TILES_DECODED);
+			if (stat(path.c_str(), &st) == 0)
+				metrics->add(METRIC_BYTES_READ, (uint64_t)st.st_size);
+		}
+	}
+	if (flatField && !corrected) {
+		TraceSpan span("flat_field");
+		if (memoryBacked)
+			cachedImage = memoryImage.clone();
+		if (!flatField->apply(cachedImage))
+			return false;
+		corrected = true;
 	}
+	return true;
+}
+
+/**
+ * Gets the single channel plane of the tile that overlaps are measured on.
+ * For colour tiles this is derived once and kept along with the tile.
+ */
+bool ScanImage::getImage(cv::Mat& image)
+{
+	if (!loadImage())
+		return false;
+	if (cachedImage.channels() == 1) {
+		image = cachedImage;
+		return true;
+	}
+	if (cachedPlane.empty()) {
+		if (alignChannel >= 0 && alignChannel < cachedImage.channels())
+			extractChannel(cachedImage, cachedPlane, alignChannel);
+		else
+			cvtColor(cachedImage, cachedPlane, cachedImage.channels() == 4 ? COLOR_BGRA2GRAY : COLOR_BGR2GRAY);
+	}
+	image = cachedPlane;
+	return true;
+}
+
+/**
+ * Gets the tile with all its channels, the same as getImage for grayscale
+ * tiles.
+ */
+bool ScanImage::getColorImage(cv::Mat& image)
+{
+	if (!loadImage())
+		return false;
 	image = cachedImage;
 	return true;
 }
@@ -217,11 +625,95 @@ bool ScanImage::getImageF32(cv::Mat& image)
 void ScanImage::evictImage()
 {
 	evictImageF32();
+	cachedPlane.release();
+
+	/* Memory backed images have nowhere to be reloaded from, only the
+	 * corrected copy can go */
+	if (memoryBacked) {
+		if (corrected)
+			cachedImage = memoryImage;
+		corrected = false;
+		return;
+	}
 	cachedImage.create(0, 0, CV_16F);
 	cached = false;
 
 }
 
+/**
+ * Turns this into a memory backed image. owner is kept alive for as long as
+ * the image is, and may be null when image manages its own memory.
+ */
+void ScanImage::setMemoryImage(cv::Mat image, std::shared_ptr<void> owner)
+{
+	evictImageF32();
+	cachedPlane.release();
+	memoryImage  = image;
+	cachedImage  = image;
+	cached       = !cachedImage.empty();
+	corrected    = false;
+	memoryBacked = true;
+	memoryOwner  = owner;
+	contentChanged();
+}
+
+/**
+ * Returns a hash identifying this tile, covering its path, its content and
+ * the plane getImage returns. For file backed images the raw file is hashed,
+ * which is a lot cheaper than decoding it. The result is computed once and
+ * remembered.
+ *
+ * @return the hash, or 0 if the image data could not be read
+ */
+uint64_t ScanImage::contentHash()
+{
+	std::vector<uint8_t> buf;
+	uint64_t h;
+	int plane[2];
+	size_t n;
+	FILE* f;
+
+	if (hashed)
+		return hash;
+
+	h = hashBytes(path.data(), path.size(), 0);
+	if (flatField) {
+		uint64_t ff = flatField->hash();
+		h = hashBytes(&ff, sizeof ff, h);
+	}
+	/* Overlaps measured on another plane must not be found in the cache */
+	plane[0] = color;
+	plane[1] = color ? alignChannel : CHANNEL_LUMA;
+	h = hashBytes(plane, sizeof plane, h);
+	if (memoryBacked) {
+		int dims[3] = { memoryImage.rows, memoryImage.cols, memoryImage.type() };
+		h = hashBytes(dims, sizeof dims, h);
+		for (int y = 0; y < memoryImage.rows; y++)
+			h = hashBytes(memoryImage.ptr(y), memoryImage.cols * memoryImage.elemSize(), h);
+	} else {
+		f = fopen(path.c_str(), "rb");
+		if (!f)
+			return 0;
+		buf.resize(1 << 20);
+		while ((n = fread(buf.data(), 1, buf.size(), f)) > 0)
+			h = hashBytes(buf.data(), n, h);
+		fclose(f);
+	}
+	hash   = h;
+	hashed = true;
+	return hash;
+}
+
+/**
+ * Drops everything derived from the pixels that eviction keeps.
+ */
+void ScanImage::contentChanged()
+{
+	hashed = false;
+	for (SparseSamples& s : sparse)
+		s.clear();
+}
+
 void ScanImage::evictImageF32()
 {
 	cachedF32Img.create(0, 0, CV_16F);
@@ -248,11 +740,7 @@ bool ScanSet::hasImageAt(cv::Point2i g, int dir)
 }
 
 ScanImage& ScanSet::imageAt(int x, int y) {
-	assert(gridGenerated);
-	assert(x >= 0 && x < gridWidth);
-	assert(y >= 0 && y < gridHeight);
-	int ii = idxGrid.at<int>(y, x);
-	return m_Images[ii];
+	return m_Images[tileIndex(x, y)];
 }
 
 /*
@@ -1,17 +1,30 @@
 #pragma once
 
+#include "stitchapi.h"
 #include <opencv2/core.hpp>
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <assert.h>
+#include <stdint.h>
+#include <math.h>
+#include <memory>
+#include "Metrics.h"
+#include "FlatField.h"
+#include "stitch.h"
 
-class __declspec(dllexport) ScanImage;
+class STITCH_API ScanImage;
 
 #define DISP_UP    (0)
 #define DISP_DOWN  (1)
 #define DISP_LEFT  (2)
 #define DISP_RIGHT (3)
 
+#define TILE_PRESENT         (1)
+#define TILE_DISP_VALID(dir) (2 << (dir))
+
+#define CHANNEL_LUMA (-1)   /* Align colour tiles on their luminance, see ScanSet::setColor */
+
 #define SAVE_FLAG_DISPLACEMENTS (1)
 #define SAVE_FLAG_SOLVER_OPT    (2)
 #define SAVE_FLAG_MATRIX        (4)
@@ -20,7 +33,11 @@ class __declspec(dllexport) ScanImage;
 #define SAVE_FLAGS_INPUT (0)
 #define SAVE_FLAGS_GRID  (SAVE_FLAG_GRID_SIZE)
 
-extern cv::Point2i DISP_DIRECTIONS[4];
+extern STITCH_API cv::Point2i DISP_DIRECTIONS[4];
+
+typedef void (*image_release_cb_t)(void* arg, void* data);
+
+#ifdef _MSC_VER
 template class __declspec(dllexport) cv::Point_<double>;
 template class __declspec(dllexport) cv::Point_<float>;
 template class __declspec(dllexport) cv::Point_<int>;
@@ -28,38 +45,92 @@ template class __declspec(dllexport) cv::Rect_<int>;
 template class __declspec(dllexport) cv::Size_<int>;
 class __declspec(dllexport) cv::Mat;
 template class __declspec(dllexport) std::basic_string<char, std::char_traits<char>, std::allocator<char>>;
-
+#endif
+
+/**
+ * Image handle for a single tile. The positional data for the tile is kept
+ * in the owning ScanSet, this only knows how to get at the pixels.
+ *
+ * Tiles are either file backed, and loaded from path on demand, or memory
+ * backed, in which case the pixels are owned by the caller (or by the Mat
+ * that was handed over) and are never evicted.
+ *
+ * Colour tiles are decoded once and kept with all their channels, overlap
+ * searches only ever see a single channel plane derived from them.
+ *
+ * A flat-field correction, if set, is applied once right after decoding.
+ * Memory backed tiles are corrected into a copy, the caller's pixels are
+ * never modified.
+ */
 class ScanImage
 {
 public:
-	cv::Point2i     gridPosition;
-	cv::Point2f     stagePosition;
-	cv::Point2i     stitchPosition;
 	std::string     path;
-	cv::Point2i     displacements[4];
+
+	/* Samples picked for sparse searches against the neighbour in each
+	 * direction. Tiny next to the pixels, so they outlive eviction and only
+	 * go when the pixels change */
+	SparseSamples   sparse[4];
 
 	bool            getImage(cv::Mat& out);
+	bool            getColorImage(cv::Mat& out);
 	bool            getImageF32(cv::Mat& out);
 	void            evictImage();
 	void            evictImageF32();
+	void            setMemoryImage(cv::Mat image, std::shared_ptr<void> owner);
+	bool            isMemoryBacked() const { return memoryBacked; }
+	uint64_t        contentHash();
+	void            setMetrics(Metrics* metrics) { this->metrics = metrics; }
+	void            setColor(bool color, int alignChannel);
+	void            setFlatField(std::shared_ptr<const FlatField> flatField);
 private:
+	bool            loadImage();
+	void            contentChanged();
+
 	cv::Mat         cachedImage;
+	cv::Mat         cachedPlane;    /* Alignment plane of a colour image */
 	cv::Mat         cachedF32Img;
 	bool            cachedF32 = false;
 	bool            cached = false;
+	bool            memoryBacked = false;
+	bool            hashed = false;
+	uint64_t        hash = 0;
+	std::shared_ptr<void> memoryOwner;
+	Metrics*        metrics = nullptr;
+	bool            color = false;
+	int             alignChannel = CHANNEL_LUMA;
+	cv::Mat         memoryImage;    /* The caller's pixels, cachedImage may be a corrected copy */
+	bool            corrected = false;
+	std::shared_ptr<const FlatField> flatField;
 };
 
+#ifdef _MSC_VER
 template class __declspec(dllexport) std::_Vector_val<std::_Simple_types<ScanImage>>;
 template class __declspec(dllexport) std::_Compressed_pair<std::allocator<ScanImage>, std::_Vector_val<std::_Simple_types<ScanImage>>, true>;
 template class __declspec(dllexport) std::vector<ScanImage>;
-
-class  __declspec(dllexport) ScanSet
+template class __declspec(dllexport) std::_Vector_val<std::_Simple_types<cv::Point2i>>;
+template class __declspec(dllexport) std::_Compressed_pair<std::allocator<cv::Point2i>, std::_Vector_val<std::_Simple_types<cv::Point2i>>, true>;
+template class __declspec(dllexport) std::vector<cv::Point2i>;
+template class __declspec(dllexport) std::_Vector_val<std::_Simple_types<cv::Point2f>>;
+template class __declspec(dllexport) std::_Compressed_pair<std::allocator<cv::Point2f>, std::_Vector_val<std::_Simple_types<cv::Point2f>>, true>;
+template class __declspec(dllexport) std::vector<cv::Point2f>;
+template class __declspec(dllexport) std::_Vector_val<std::_Simple_types<uint8_t>>;
+template class __declspec(dllexport) std::_Compressed_pair<std::allocator<uint8_t>, std::_Vector_val<std::_Simple_types<uint8_t>>, true>;
+template class __declspec(dllexport) std::vector<uint8_t>;
+template class __declspec(dllexport) std::_Vector_val<std::_Simple_types<float>>;
+template class __declspec(dllexport) std::_Compressed_pair<std::allocator<float>, std::_Vector_val<std::_Simple_types<float>>, true>;
+template class __declspec(dllexport) std::vector<float>;
+#endif
+
+class STITCH_API ScanSet
 {
 
 private:
 	bool                   gridGenerated = false;
 	bool                   vecsGenerated = false;
-	cv::Mat                idxGrid;
+	bool                   liveGrid = false;
+	cv::Point2i            liveGridOrigin;
+	cv::Point2i            liveGridStep;
 public:
 	cv::Rect               stitchRect;
 	cv::Point2f            stageOrigin;
@@ -68,11 +139,40 @@ public:
 	cv::Matx23f            affineStageToImage;
 	int                    gridWidth = -1;
 	int                    gridHeight = -1;
-	std::vector<ScanImage> m_Images;
+
+	/*
+	 * Per-tile data, kept as a structure of arrays so the grid-wide passes
+	 * walk contiguous memory. Before generateGrid these are in the order the
+	 * images were added, afterwards they are in row-major grid order: tile
+	 * (x,y) lives at index y * gridWidth + x (see tileIndex).
+	 */
+	std::vector<ScanImage>   m_Images;
+	std::vector<cv::Point2i> gridPositions;
+	std::vector<cv::Point2f> stagePositions;
+	std::vector<cv::Point2i> stitchPositions;
+	std::vector<cv::Point2i> displacements[4];
+	std::vector<float>       pairScores[4];     /* Score of each displacement, NAN if unknown */
+	std::vector<uint8_t>     tileFlags;
 
 	void addImage(std::string path, cv::Point2i gridPosition, cv::Point2f stagePosition);
+	void addImage(cv::Mat&& image, cv::Point2i gridPosition, cv::Point2f stagePosition);
+	void addImage(void* data, cv::Size size, int type, size_t step, image_release_cb_t release, void* releaseArg,
+	              cv::Point2i gridPosition, cv::Point2f stagePosition);
 
-	void generateGrid();
+	bool generateGrid();
+
+	void declareGrid(cv::Point2i gridOrigin, cv::Point2i gridStep, int width, int height, cv::Point2f stageOrigin);
+	bool isLive() const { return liveGrid; }
+	cv::Point2i gridSlot(cv::Point2i gridPosition) const;
+
+	int tileCount() const { return (int) m_Images.size(); }
+	int tileIndex(int x, int y) const {
+		assert(gridGenerated);
+		assert(x >= 0 && x < gridWidth);
+		assert(y >= 0 && y < gridHeight);
+		return y * gridWidth + x;
+	}
+	int tileIndex(cv::Point2i g) const { return tileIndex(g.x, g.y); }
 
 	ScanImage& imageAt(cv::Point2i g);
 	ScanImage &imageAt(int x, int y);
@@ -80,14 +180,41 @@ public:
 	ScanImage& imageAt(int x, int y, int dir);
 	bool hasImageAt(cv::Point2i g, int dir);
 
+	cv::Point2f& stagePositionAt(cv::Point2i g) { return stagePositions[tileIndex(g)]; }
+	cv::Point2f& stagePositionAt(int x, int y) { return stagePositions[tileIndex(x, y)]; }
+	cv::Point2i& stitchPositionAt(cv::Point2i g) { return stitchPositions[tileIndex(g)]; }
+	cv::Point2i& stitchPositionAt(int x, int y) { return stitchPositions[tileIndex(x, y)]; }
+	cv::Point2i& displacementAt(cv::Point2i g, int dir) { return displacements[dir][tileIndex(g)]; }
+	cv::Point2i& displacementAt(int x, int y, int dir) { return displacements[dir][tileIndex(x, y)]; }
+
+	bool hasTile(cv::Point2i g) const { return (tileFlags[tileIndex(g)] & TILE_PRESENT) != 0; }
+	bool hasDisplacement(cv::Point2i g, int dir) const { return (tileFlags[tileIndex(g)] & TILE_DISP_VALID(dir)) != 0; }
+	float pairScoreAt(cv::Point2i g, int dir) const { return pairScores[dir][tileIndex(g)]; }
+	void setDisplacement(cv::Point2i g, int dir, cv::Point2i dr, float score = NAN);
+
 	void saveOverlaps(std::string path);
 
-	void saveProject(std::string path, int flags );
+	bool saveProject(std::string path, int flags );
 
 	void loadOverlaps(std::string path);
 
+	cv::Rect shardBlock(int index, int shardsX, int shardsY) const;
+	void saveOverlapShard(std::string path, cv::Rect block);
+	int mergeOverlapShards(const std::vector<std::string>& paths);
+
 	void loadInput(std::string path);
 
 	void evictAllF32();
+
+	void setMetrics(Metrics* metrics);
+	void setColor(bool color, int alignChannel = CHANNEL_LUMA);
+	bool setFlatField(const cv::Mat& flat, const cv::Mat& dark = cv::Mat());
+private:
+	Metrics*               metrics = nullptr;
+	bool                   color = false;
+	int                    alignChannel = CHANNEL_LUMA;
+	std::shared_ptr<const FlatField> flatField;
+
+	void insertImage(ScanImage& image, cv::Point2i gridPosition, cv::Point2f stagePosition);
 };
 
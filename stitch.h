@@ -1,9 +1,50 @@
 #pragma once
 
 #include <opencv2/core.hpp>
+#include "stitchapi.h"
 
-bool getOverlapRoi(cv::Mat& imageA, cv::Mat& imageB, cv::Point2i dr, cv::Mat& roiA, cv::Mat& roiB);
-float scoreOverlap(cv::Mat& imageA, cv::Mat& imageB, cv::Point2i dr);
+class Executor;
+
+/* Identifies the scoring method used to find overlaps, so cached results
+ * from one method are never reused for another */
+#define OVERLAP_ENGINE_SSD      (0)
+#define OVERLAP_ENGINE_EDGE     (1)   /* Binarised edge maps compared with XOR and popcount, see EdgeMap */
+#define OVERLAP_ENGINE_EDGE_SSD (2)   /* Edge maps on the coarse levels, SSD at full resolution */
+#define OVERLAP_ENGINE_SPARSE   (3)   /* SSD on gradient picked samples on the coarse levels, full SSD at full resolution */
+
+#define OVERLAP_MAX_LEVELS (8)
+
+/**
+ * Optional instrumentation filled in by the overlap search functions.
+ */
+struct OverlapStats
+{
+	int evaluations[OVERLAP_MAX_LEVELS]; /* scoreOverlap calls per pyramid level, 0 is full resolution */
+};
+
+/**
+ * Samples of an image picked by findBestSparseOverlap, one set per pyramid
+ * level. Searches that are handed the same SparseSamples for the same image
+ * reuse them instead of picking them again, see ScanImage::sparse.
+ */
+struct SparseSamples
+{
+	cv::Size source;                      /* Size of the image they were picked from */
+	cv::Rect region[OVERLAP_MAX_LEVELS];  /* Part of the level they cover, empty if none picked yet */
+	cv::Mat  samples[OVERLAP_MAX_LEVELS]; /* (x, y, value) rows, CV_32FC3 */
+
+	void clear()
+	{
+		source = cv::Size();
+		for (int l = 0; l < OVERLAP_MAX_LEVELS; l++) {
+			region[l] = cv::Rect();
+			samples[l].release();
+		}
+	}
+};
+
+STITCH_API bool getOverlapRoi(cv::Mat& imageA, cv::Mat& imageB, cv::Point2i dr, cv::Mat& roiA, cv::Mat& roiB);
+STITCH_API float scoreOverlap(cv::Mat& imageA, cv::Mat& imageB, cv::Point2i dr);
 
 /**
  * Finds the displacement best fitting two overlapping images together.
@@ -14,8 +55,10 @@ float scoreOverlap(cv::Mat& imageA, cv::Mat& imageB, cv::Point2i dr);
  * @param range      Amount of pixels to deviate from the starting point
  * @param decimate   Factor by which to decimate the image before searching
  * @param dr         Displacement giving the best overlap
+ * @param executor   If not null, the candidates are scored in parallel on the
+ *                   threads of executor that are idle, see Executor::idleThreads
  */
-float findBestOverlap(cv::Mat& imageA, cv::Mat& imageB, cv::Point2i guess, cv::Point2i range, int decimate, cv::Point2i& dr);
+STITCH_API float findBestOverlap(cv::Mat& imageA, cv::Mat& imageB, cv::Point2i guess, cv::Point2i range, int decimate, cv::Point2i& dr, int* evaluations = nullptr, Executor* executor = nullptr);
 
 /**
  * Efficiently finds the displacement best fitting two overlapping images together.
@@ -28,5 +71,12 @@ float findBestOverlap(cv::Mat& imageA, cv::Mat& imageB, cv::Point2i guess, cv::P
  * @param logd       log2 of the maximum decimation factor
  * @param dr         Displacement giving the best overlap
  */
-float iterBestOverlap(cv::Mat& imageA, cv::Mat& imageB, cv::Point2i guess, cv::Point2i range, int logd, cv::Point2i& dr);
-float iterBestOverlapNC(cv::Mat& imageA, cv::Mat& imageB, cv::Point2i guess, cv::Point2i range, int logd, cv::Point2i& dr);
\ No newline at end of file
+STITCH_API float iterBestOverlap(cv::Mat& imageA, cv::Mat& imageB, cv::Point2i guess, cv::Point2i range, int logd, cv::Point2i& dr);
+STITCH_API float iterBestOverlapNC(cv::Mat& imageA, cv::Mat& imageB, cv::Point2i guess, cv::Point2i range, int logd, cv::Point2i& dr, OverlapStats* stats = nullptr, Executor* executor = nullptr);
+STITCH_API float findBestEdgeOverlap(cv::Mat& imageA, cv::Mat& imageB, cv::Point2i guess, cv::Point2i range, int decimate, cv::Point2i& dr, int* evaluations = nullptr, Executor* executor = nullptr);
+STITCH_API float findBestSparseOverlap(cv::Mat& imageA, cv::Mat& imageB, cv::Point2i guess, cv::Point2i range, int decimate, cv::Point2i& dr, int* evaluations = nullptr, Executor* executor = nullptr,
+                                       SparseSamples* samplesA = nullptr);
+STITCH_API float iterBestOverlapEngine(cv::Mat& imageA, cv::Mat& imageB, cv::Point2i guess, cv::Point2i range, int logd, cv::Point2i& dr, int engine,
+                                       OverlapStats* stats = nullptr, Executor* executor = nullptr, SparseSamples* samplesA = nullptr);
+STITCH_API float iterBestOverlapEdge(cv::Mat& imageA, cv::Mat& imageB, cv::Point2i guess, cv::Point2i range, int logd, cv::Point2i& dr, bool refine,
+                                     OverlapStats* stats = nullptr, Executor* executor = nullptr);
\ No newline at end of file
@@ -0,0 +1,8 @@
+#pragma once
+
+/* Marks classes and functions exported from the library */
+#if defined(_WIN32)
+#define STITCH_API __declspec(dllexport)
+#else
+#define STITCH_API __attribute__((visibility("default")))
+#endif
@@ -0,0 +1,154 @@
+/*
+ * Resumes an overlap run from the journal of a run that went on to
+ * re-measure an outlier. The journal has to describe the overlap pass alone:
+ * one record per pair, replayed to what that pass measured, under the
+ * search parameters it was opened with.
+ */
+#include "scanset.h"
+#include "AffineOverlapSolver.h"
+#include "OverlapJournal.h"
+#include "RelaxationSolver.h"
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+using namespace cv;
+
+#define GRID_W  (4)
+#define GRID_H  (3)
+#define JOURNAL "journal_resume_test.journal"
+
+static const Size    tileSize(192, 160);
+static const Point2i tileStep(160, 128);
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+	if (!ok) {
+		fprintf(stderr, "FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+static Mat makeScene()
+{
+	Mat noise(Size(tileStep.x * (GRID_W - 1) + tileSize.width, tileStep.y * (GRID_H - 1) + tileSize.height), CV_32F);
+	Mat scene;
+	RNG rng(42);
+
+	rng.fill(noise, RNG::UNIFORM, Scalar(0), Scalar(1));
+	GaussianBlur(noise, noise, Size(0, 0), 2.0);
+	normalize(noise, noise, 0, 65535, NORM_MINMAX);
+	noise.convertTo(scene, CV_16U);
+	return scene;
+}
+
+static void makeScanSet(ScanSet& set, const Mat& scene)
+{
+	for (int y = 0; y < GRID_H; y++) {
+		for (int x = 0; x < GRID_W; x++) {
+			Point2i p(x * tileStep.x, y * tileStep.y);
+			set.addImage(scene(Rect(p, tileSize)).clone(), Point2i(x, y), Point2f(p));
+		}
+	}
+	set.generateGrid();
+	set.affineStageToImage = Matx23f(1, 0, 0, 0, 1, 0);
+}
+
+static void setupSolver(AffineOverlapSolver& solver)
+{
+	solver.setNumThreads(1);
+	solver.setParameters(GUESS_FIXED, 32, 2, tileSize, Point2i(8, 8), Point2i(8, 8));
+	solver.setFixedGuess(Point2i(tileStep.x, 0), Point2i(0, tileStep.y));
+}
+
+static int countRecords(const char* path)
+{
+	FILE* f = fopen(path, "rb");
+	char line[256];
+	int n = 0;
+
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof line, f))
+		if (line[0] != '#')
+			n++;
+	fclose(f);
+	return n;
+}
+
+int main()
+{
+	Mat scene = makeScene();
+	std::vector<Vec3i> pairs;
+	std::vector<Point2i> measured;
+
+	remove(JOURNAL);
+	for (int y = 0; y < GRID_H; y++) {
+		for (int x = 0; x < GRID_W; x++) {
+			if (y + 1 < GRID_H)
+				pairs.push_back(Vec3i(x, y, DISP_DOWN));
+			if (x + 1 < GRID_W)
+				pairs.push_back(Vec3i(x, y, DISP_RIGHT));
+		}
+	}
+
+	/* First run: the overlap pass, then an outlier to re-measure */
+	{
+		ScanSet set;
+		AffineOverlapSolver solver;
+		RelaxationSolver relax;
+		OverlapJournal journal;
+
+		makeScanSet(set, scene);
+		setupSolver(solver);
+		check(journal.open(JOURNAL, GRID_W, GRID_H, 1, solver.searchHash()), "open a new journal");
+		solver.setJournal(&journal);
+		solver.computeOverlapsY(set);
+		solver.computeOverlapsX(set);
+		for (const Vec3i& p : pairs)
+			measured.push_back(set.displacementAt(Point2i(p[0], p[1]), p[2]));
+
+		Point2i g(1, 1);
+		set.setDisplacement(g, DISP_RIGHT, set.displacementAt(g, DISP_RIGHT) + Point2i(30, -24),
+		                    set.pairScoreAt(g, DISP_RIGHT));
+		relax.setup(set, 100);
+		relax.run(500);
+		check(solver.remeasureOutliers(set, 4.f) > 0, "re-measure the injected outlier");
+		check(solver.searchHash() == journal.searchHash(), "restore the search parameters after re-measuring");
+		journal.close();
+	}
+
+	check(countRecords(JOURNAL) == (int)pairs.size(), "journal holds one record per pair");
+
+	/* Resumed run: everything comes back from the journal as measured */
+	{
+		ScanSet set;
+		AffineOverlapSolver solver;
+		OverlapJournal journal;
+
+		makeScanSet(set, scene);
+		setupSolver(solver);
+		check(journal.open(JOURNAL, GRID_W, GRID_H, 1, solver.searchHash()), "reopen the journal");
+		check(journal.replay(set) == (int)pairs.size(), "replay every pair");
+		for (size_t i = 0; i < pairs.size(); i++) {
+			Point2i g(pairs[i][0], pairs[i][1]);
+			check(set.hasDisplacement(g, pairs[i][2]) && set.displacementAt(g, pairs[i][2]) == measured[i],
+			      "replayed displacement matches the overlap pass");
+		}
+		solver.setJournal(&journal);
+		solver.computeOverlapsY(set);
+		solver.computeOverlapsX(set);
+		journal.close();
+	}
+
+	check(countRecords(JOURNAL) == (int)pairs.size(), "resumed run measures nothing again");
+	remove(JOURNAL);
+	if (failures)
+		return 1;
+	printf("journal_resume: ok\n");
+	return 0;
+}
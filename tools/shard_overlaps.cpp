@@ -0,0 +1,218 @@
+/*
+ * Splits the overlap computation of a scan over several processes.
+ *
+ * Usage: microstitch_shard compute --project PATH --shards XxY --index N --out PART [options]
+ *        microstitch_shard merge --project PATH --out OVERLAPS PART...
+ *
+ * Every compute run measures the pairs of one block of the grid and writes
+ * them to a partial overlap file, the runs share nothing but the project and
+ * can be spread over hosts. merge combines the partial files into a complete
+ * overlap file as written by ScanSet::saveOverlaps.
+ */
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "scanset.h"
+#include "AffineOverlapSolver.h"
+
+using namespace cv;
+
+struct ShardOptions
+{
+	std::string project;
+	std::string out;
+	std::vector<std::string> parts;
+	Size        shards;
+	int         index = -1;
+	Size        crop;
+	Point2i     step;
+	int         range = 16;
+	int         matrixRange = 32;
+	int         logd = 2;
+	int         threads = 0;
+	bool        verbose = false;
+	bool        adaptive = false;
+};
+
+static void logCallback(Solver*, void* arg, int level, std::string message)
+{
+	bool verbose = *(bool*)arg;
+
+	if (verbose || level >= SLOG_WARN)
+		fprintf(stderr, "%s\n", message.c_str());
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr,
+		"usage: %s compute --project PATH --shards XxY --index N --out PART [options]\n"
+		"       %s merge --project PATH --out OVERLAPS PART...\n"
+		"compute options:\n"
+		"  --crop WxH          crop tiles to this size (tile size)\n"
+		"  --nominal-step XxY  nominal tile step in pixels for the matrix calibration (from project)\n"
+		"  --range N           overlap search range (16)\n"
+		"  --matrix-range N    search range for the matrix calibration (32)\n"
+		"  --logd N            log2 of the coarsest decimation (2)\n"
+		"  --threads N         number of threads (all)\n"
+		"  --adaptive          predict guesses from neighbouring pairs (GUESS_ADAPTIVE)\n"
+		"  --verbose           show solver log messages\n", name, name);
+}
+
+static bool loadProject(ScanSet& set, const std::string& path)
+{
+	set.loadInput(path);
+	if (set.m_Images.empty()) {
+		fprintf(stderr, "no images in \"%s\"\n", path.c_str());
+		return false;
+	}
+	if (!set.generateGrid()) {
+		fprintf(stderr, "the tiles of \"%s\" do not form a regular grid\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+static int compute(ShardOptions& opt)
+{
+	ScanSet set;
+	AffineOverlapSolver solver;
+	ThreadPool pool(opt.threads);
+
+	if (opt.shards.area() <= 0 || opt.index < 0 || opt.index >= opt.shards.area()) {
+		fprintf(stderr, "shard index %i out of range\n", opt.index);
+		return 1;
+	}
+
+	/* Take the nominal step from a synthetic project, unless overridden */
+	{
+		FileStorage fs(opt.project, FileStorage::READ);
+		FileNode s = fs["synth"];
+		if (!s.empty() && opt.step == Point2i(0, 0))
+			opt.step = Point2i((int)s["step"][0], (int)s["step"][1]);
+	}
+	if (opt.step == Point2i(0, 0)) {
+		fprintf(stderr, "the nominal tile step is not known, use --nominal-step\n");
+		return 1;
+	}
+
+	if (!loadProject(set, opt.project))
+		return 1;
+	if (opt.crop.area() == 0) {
+		Mat first;
+		if (!set.imageAt(0, 0).getImage(first)) {
+			fprintf(stderr, "could not read \"%s\"\n", set.imageAt(0, 0).path.c_str());
+			return 1;
+		}
+		opt.crop = first.size();
+	}
+	if (opt.threads > 0)
+		setNumThreads(opt.threads);
+	solver.setLogCB(logCallback, &opt.verbose);
+	solver.setExecutor(&pool);
+
+	/* Every shard calibrates on the same pairs, so all of them end up with
+	 * the same matrix without having to pass it around */
+	solver.setParameters(GUESS_FIXED, 1000, opt.logd, opt.crop,
+	                     Point2i(opt.matrixRange, opt.matrixRange), Point2i(opt.matrixRange, opt.matrixRange));
+	solver.setFixedGuess(Point2i(opt.step.x, 0), Point2i(0, opt.step.y));
+	solver.computeMatrix(set, (set.gridWidth - 1) / 2, (set.gridHeight - 1) / 2);
+	solver.applyInitialGrid(set);
+
+	Rect block = set.shardBlock(opt.index, opt.shards.width, opt.shards.height);
+	solver.setParameters(opt.adaptive ? GUESS_ADAPTIVE : GUESS_STAGE, 4 * opt.range, opt.logd, opt.crop,
+	                     Point2i(opt.range, opt.range), Point2i(opt.range, opt.range));
+	solver.computeOverlapsShard(set, block);
+	set.saveOverlapShard(opt.out, block);
+	printf("shard %i: block (%i,%i) %ix%i written to %s\n",
+	       opt.index, block.x, block.y, block.width, block.height, opt.out.c_str());
+	return 0;
+}
+
+static int merge(ShardOptions& opt)
+{
+	ScanSet set;
+	int merged, missing = 0;
+
+	if (opt.parts.empty()) {
+		fprintf(stderr, "no partial overlap files given\n");
+		return 1;
+	}
+	if (!loadProject(set, opt.project))
+		return 1;
+	merged = set.mergeOverlapShards(opt.parts);
+	if (merged < 0) {
+		fprintf(stderr, "could not merge, a partial file is unreadable or from another grid\n");
+		return 1;
+	}
+	for (int y = 0; y < set.gridHeight; y++)
+		for (int x = 0; x < set.gridWidth; x++)
+			for (int d : { DISP_DOWN, DISP_RIGHT })
+				if (set.hasImageAt(Point2i(x, y), d) && !set.hasDisplacement(Point2i(x, y), d))
+					missing++;
+	set.saveOverlaps(opt.out);
+	printf("merged %i pairs from %i files into %s\n", merged, (int)opt.parts.size(), opt.out.c_str());
+	if (missing) {
+		fprintf(stderr, "%i pairs are missing, not all shards were merged\n", missing);
+		return 2;
+	}
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	ShardOptions opt;
+	std::string mode;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+	mode = argv[1];
+	for (int i = 2; i < argc; i++) {
+		std::string a = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (a == "--verbose")
+			opt.verbose = true;
+		else if (a == "--adaptive")
+			opt.adaptive = true;
+		else if (a == "--project" && hasValue)
+			opt.project = argv[++i];
+		else if (a == "--out" && hasValue)
+			opt.out = argv[++i];
+		else if (a == "--shards" && hasValue)
+			sscanf(argv[++i], "%ix%i", &opt.shards.width, &opt.shards.height);
+		else if (a == "--index" && hasValue)
+			opt.index = atoi(argv[++i]);
+		else if (a == "--crop" && hasValue)
+			sscanf(argv[++i], "%ix%i", &opt.crop.width, &opt.crop.height);
+		else if (a == "--nominal-step" && hasValue)
+			sscanf(argv[++i], "%ix%i", &opt.step.x, &opt.step.y);
+		else if (a == "--range" && hasValue)
+			opt.range = atoi(argv[++i]);
+		else if (a == "--matrix-range" && hasValue)
+			opt.matrixRange = atoi(argv[++i]);
+		else if (a == "--logd" && hasValue)
+			opt.logd = atoi(argv[++i]);
+		else if (a == "--threads" && hasValue)
+			opt.threads = atoi(argv[++i]);
+		else if (mode == "merge" && a.compare(0, 2, "--") != 0)
+			opt.parts.push_back(a);
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (opt.project.empty() || opt.out.empty()) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (mode == "compute")
+		return compute(opt);
+	if (mode == "merge")
+		return merge(opt);
+	usage(argv[0]);
+	return 1;
+}
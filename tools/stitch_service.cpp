@@ -0,0 +1,527 @@
+/*
+ * Keeps scans, their decoded tiles, overlap caches and a thread pool warm
+ * between stitch jobs, so tuning a scan or re-rendering part of it for a
+ * viewer does not start from scratch every time.
+ *
+ * Usage: microstitch_service --socket PATH [--threads N] [--verbose]
+ *
+ * Clients connect to the Unix domain socket and send one job per line:
+ *
+ *   load PROJECT [color=1] [flat=PATH] [dark=PATH] [crop=WxH]
+ *   overlaps PROJECT [step=XxY] [range=N] [matrix-range=N] [logd=N] [calibrate=N] [adaptive=1]
+ *   solve PROJECT [iters=N] [sanity=N]
+ *   render PROJECT out=PATH [decimate=N] [region=X,Y,WxH]
+ *   save PROJECT out=PATH
+ *   drop PROJECT
+ *   status
+ *   shutdown
+ *
+ * Scans are known by their project path and loaded by the first job that
+ * names them. Every job can carry priority=N (0 by default, higher first);
+ * jobs run one at a time, each on all threads of the pool. Each line is
+ * answered with "ok ..." or "error ..." once its job has run, several jobs
+ * sent on one connection are answered in order.
+ */
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "scanset.h"
+#include "AffineOverlapSolver.h"
+#include "RelaxationSolver.h"
+#include "SimpleStitcher.h"
+
+using namespace cv;
+
+typedef std::map<std::string, std::string> JobArgs;
+
+/**
+ * A scan with everything kept from one job to the next.
+ */
+struct Scan
+{
+	ScanSet             set;
+	AffineOverlapSolver overlaps;
+	RelaxationSolver    relax;
+	SimpleStitcher      stitcher;
+	OverlapCache        cache;
+	Size                crop;
+	std::string         error;         /* Fatal error of the running job */
+
+	/* Calibration the stage matrix is valid for */
+	bool                calibrated = false;
+	Point2i             step;
+	int                 matrixRange = 0;
+	int                 logd = 0;
+	int                 calibrate = 0;
+	bool                overlapsDone = false;
+	bool                solved = false;
+};
+
+struct Job
+{
+	int                       priority = 0;
+	uint64_t                  seq = 0;
+	std::string               command;
+	std::string               project;
+	JobArgs                   args;
+	std::promise<std::string> reply;
+};
+
+struct JobOrder
+{
+	bool operator()(const std::shared_ptr<Job>& a, const std::shared_ptr<Job>& b) const {
+		return a->priority != b->priority ? a->priority < b->priority : a->seq > b->seq;
+	}
+};
+
+struct Service
+{
+	ThreadPool*                                 pool = nullptr;
+	bool                                        verbose = false;
+	int                                         listenFd = -1;
+	std::map<std::string, std::unique_ptr<Scan>> scans;
+
+	std::mutex                                  lock;
+	std::condition_variable                     wake;
+	std::priority_queue<std::shared_ptr<Job>, std::vector<std::shared_ptr<Job>>, JobOrder> queue;
+	uint64_t                                    nextSeq = 0;
+	bool                                        stopping = false;
+
+	/* Open client connections by id, and clients main has yet to join */
+	std::map<uint64_t, int>                     clientFds;
+	std::vector<uint64_t>                       finishedClients;
+};
+
+static void logCallback(Solver*, void* arg, int level, std::string message)
+{
+	bool verbose = ((Service*)arg)->verbose;
+
+	if (verbose || level >= SLOG_WARN)
+		fprintf(stderr, "%s\n", message.c_str());
+}
+
+static void fatalCallback(Solver*, void* arg, std::string message)
+{
+	((Scan*)arg)->error = message;
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr,
+		"usage: %s --socket PATH [options]\n"
+		"  --threads N         number of threads (all)\n"
+		"  --verbose           show solver log messages\n", name);
+}
+
+static int argInt(const JobArgs& args, const char* key, int def)
+{
+	auto it = args.find(key);
+	return it == args.end() ? def : atoi(it->second.c_str());
+}
+
+static std::string argString(const JobArgs& args, const char* key)
+{
+	auto it = args.find(key);
+	return it == args.end() ? std::string() : it->second;
+}
+
+static std::string loadScan(Service& svc, const std::string& project, const JobArgs& args, Scan*& out)
+{
+	std::unique_ptr<Scan> scan(new Scan());
+	ScanSet& set = scan->set;
+
+	set.loadInput(project);
+	if (set.m_Images.empty())
+		return "error no images in \"" + project + "\"";
+	if (!set.generateGrid())
+		return "error the tiles of \"" + project + "\" do not form a regular grid";
+	set.setColor(argInt(args, "color", 0) != 0);
+
+	std::string flatPath = argString(args, "flat"), darkPath = argString(args, "dark");
+	if (!flatPath.empty() || !darkPath.empty()) {
+		int flags = IMREAD_ANYDEPTH | (argInt(args, "color", 0) ? IMREAD_ANYCOLOR : 0);
+		Mat flat = flatPath.empty() ? Mat() : imread(flatPath, flags);
+		Mat dark = darkPath.empty() ? Mat() : imread(darkPath, flags);
+		if ((!flatPath.empty() && flat.empty()) || (!darkPath.empty() && dark.empty()) || !set.setFlatField(flat, dark))
+			return "error could not use the flat-field references";
+	}
+
+	sscanf(argString(args, "crop").c_str(), "%ix%i", &scan->crop.width, &scan->crop.height);
+	if (scan->crop.area() == 0) {
+		Mat first;
+		if (!set.imageAt(0, 0).getImage(first))
+			return "error could not read \"" + set.imageAt(0, 0).path + "\"";
+		scan->crop = first.size();
+	}
+
+	/* Take the nominal step from a synthetic project */
+	{
+		FileStorage fs(project, FileStorage::READ);
+		FileNode s = fs["synth"];
+		if (!s.empty())
+			scan->step = Point2i((int)s["step"][0], (int)s["step"][1]);
+	}
+
+	for (Solver* s : { (Solver*)&scan->overlaps, (Solver*)&scan->relax, (Solver*)&scan->stitcher }) {
+		s->setLogCB(logCallback, &svc);
+		s->setFatalCB(fatalCallback, scan.get());
+		s->setExecutor(svc.pool);
+	}
+	scan->overlaps.setCache(&scan->cache);
+	/* Tiles stay decoded for the next render */
+	scan->stitcher.setKeepTiles(true);
+
+	out = scan.get();
+	svc.scans[project] = std::move(scan);
+	return "ok loaded " + std::to_string(set.tileCount()) + " tiles, grid " +
+	       std::to_string(set.gridWidth) + "x" + std::to_string(set.gridHeight);
+}
+
+static std::string computeOverlaps(Scan& scan, const JobArgs& args)
+{
+	ScanSet& set = scan.set;
+	AffineOverlapSolver& solver = scan.overlaps;
+	Point2i step = scan.step;
+	int matrixRange = argInt(args, "matrix-range", 32);
+	int range = argInt(args, "range", 16);
+	int logd = argInt(args, "logd", 2);
+	int calibrate = argInt(args, "calibrate", 0);
+
+	sscanf(argString(args, "step").c_str(), "%ix%i", &step.x, &step.y);
+	if (step == Point2i(0, 0))
+		return "error the nominal tile step is not known, pass step=XxY";
+	scan.overlapsDone = false;
+
+	/* The stage matrix only changes with the calibration parameters */
+	if (!scan.calibrated || step != scan.step || matrixRange != scan.matrixRange ||
+	    logd != scan.logd || calibrate != scan.calibrate) {
+		solver.setParameters(GUESS_FIXED, 1000, logd, scan.crop,
+		                     Point2i(matrixRange, matrixRange), Point2i(matrixRange, matrixRange));
+		solver.setFixedGuess(Point2i(step.x, 0), Point2i(0, step.y));
+		if (calibrate > 0)
+			solver.computeMatrixSampled(set, calibrate, 2.f);
+		else
+			solver.computeMatrix(set, (set.gridWidth - 1) / 2, (set.gridHeight - 1) / 2);
+		if (!scan.error.empty())
+			return "error " + scan.error;
+		scan.calibrated  = true;
+		scan.step        = step;
+		scan.matrixRange = matrixRange;
+		scan.logd        = logd;
+		scan.calibrate   = calibrate;
+	}
+	solver.applyInitialGrid(set);
+
+	/* Pairs measured before with the same parameters come from the cache */
+	solver.setParameters(argInt(args, "adaptive", 0) ? GUESS_ADAPTIVE : GUESS_STAGE, 4 * range, logd, scan.crop,
+	                     Point2i(range, range), Point2i(range, range));
+	solver.computeOverlapsY(set);
+	solver.computeOverlapsX(set);
+	if (!scan.error.empty())
+		return "error " + scan.error;
+	scan.overlapsDone = true;
+	scan.solved       = false;
+
+	int measured = 0;
+	for (int y = 0; y < set.gridHeight; y++)
+		for (int x = 0; x < set.gridWidth; x++)
+			for (int d : { DISP_DOWN, DISP_RIGHT })
+				if (set.hasImageAt(Point2i(x, y), d) && set.hasDisplacement(Point2i(x, y), d))
+					measured++;
+	return "ok " + std::to_string(measured) + " pairs";
+}
+
+static std::string solve(Scan& scan, const JobArgs& args)
+{
+	if (!scan.overlapsDone)
+		return "error no overlaps computed yet";
+	scan.relax.setup(scan.set, argInt(args, "sanity", 100));
+	scan.relax.run(argInt(args, "iters", 500));
+	if (!scan.error.empty())
+		return "error " + scan.error;
+	scan.solved = true;
+	Rect r = scan.set.stitchRect;
+	return "ok mosaic " + std::to_string(r.width + scan.crop.width) + "x" + std::to_string(r.height + scan.crop.height);
+}
+
+static std::string render(Scan& scan, const JobArgs& args)
+{
+	std::string out = argString(args, "out");
+	Rect region;
+
+	if (!scan.solved)
+		return "error not solved yet";
+	if (out.empty())
+		return "error no output path, pass out=PATH";
+	sscanf(argString(args, "region").c_str(), "%i,%i,%ix%i", &region.x, &region.y, &region.width, &region.height);
+	scan.stitcher.setRegion(region);
+	scan.stitcher.run(scan.set, out, scan.crop, std::max(1, argInt(args, "decimate", 1)));
+	if (!scan.error.empty())
+		return "error " + scan.error;
+	return "ok rendered " + out;
+}
+
+static std::string runJob(Service& svc, Job& job)
+{
+	if (job.command == "status") {
+		std::string r = "ok " + std::to_string(svc.scans.size()) + " scans";
+		for (auto& it : svc.scans)
+			r += " " + it.first;
+		return r;
+	}
+	if (job.project.empty())
+		return "error no project given";
+	if (job.command == "drop")
+		return svc.scans.erase(job.project) ? "ok dropped" : "error not loaded";
+
+	Scan* scan = nullptr;
+	auto it = svc.scans.find(job.project);
+	if (job.command == "load" || it == svc.scans.end()) {
+		std::string r = loadScan(svc, job.project, job.args, scan);
+		if (job.command == "load" || scan == nullptr)
+			return r;
+	}
+	else
+		scan = it->second.get();
+
+	scan->error.clear();
+	if (job.command == "overlaps")
+		return computeOverlaps(*scan, job.args);
+	if (job.command == "solve")
+		return solve(*scan, job.args);
+	if (job.command == "render")
+		return render(*scan, job.args);
+	if (job.command == "save") {
+		if (argString(job.args, "out").empty())
+			return "error no output path, pass out=PATH";
+		scan->set.saveOverlaps(argString(job.args, "out"));
+		return "ok saved";
+	}
+	return "error unknown job \"" + job.command + "\"";
+}
+
+/**
+ * Runs the queued jobs one at a time, highest priority first. Scans are only
+ * ever touched from here, so they need no locking.
+ */
+static void workerMain(Service& svc)
+{
+	for (;;) {
+		std::shared_ptr<Job> job;
+		{
+			std::unique_lock<std::mutex> guard(svc.lock);
+			svc.wake.wait(guard, [&] { return svc.stopping || !svc.queue.empty(); });
+			if (svc.queue.empty())
+				return;
+			job = svc.queue.top();
+			svc.queue.pop();
+		}
+		auto t0 = std::chrono::steady_clock::now();
+		std::string r = runJob(svc, *job);
+		double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		char took[32];
+		snprintf(took, sizeof took, " (%.2f s)", s);
+		job->reply.set_value(r + took);
+	}
+}
+
+static bool sendAll(int fd, const std::string& s)
+{
+	size_t done = 0;
+
+	while (done < s.size()) {
+		ssize_t n = send(fd, s.data() + done, s.size() - done, 0);
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+static std::shared_ptr<Job> parseJob(const std::string& line)
+{
+	std::shared_ptr<Job> job = std::make_shared<Job>();
+	std::istringstream in(line);
+	std::string word;
+
+	in >> job->command;
+	while (in >> word) {
+		size_t eq = word.find('=');
+		if (eq == std::string::npos && job->project.empty())
+			job->project = word;
+		else if (eq != std::string::npos)
+			job->args[word.substr(0, eq)] = word.substr(eq + 1);
+	}
+	job->priority = argInt(job->args, "priority", 0);
+	return job;
+}
+
+/** Closes a client connection and leaves its thread for main to join */
+static void closeClient(Service& svc, uint64_t id, int fd)
+{
+	{
+		std::lock_guard<std::mutex> guard(svc.lock);
+		svc.clientFds.erase(id);
+		svc.finishedClients.push_back(id);
+	}
+	close(fd);
+}
+
+static void clientMain(Service& svc, uint64_t id, int fd)
+{
+	std::string buffer;
+	char chunk[4096];
+	ssize_t n;
+
+	while ((n = recv(fd, chunk, sizeof chunk, 0)) > 0) {
+		buffer.append(chunk, n);
+		size_t nl;
+		while ((nl = buffer.find('\n')) != std::string::npos) {
+			std::string line = buffer.substr(0, nl);
+			buffer.erase(0, nl + 1);
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if (line.find_first_not_of(" \t") == std::string::npos)
+				continue;
+
+			std::shared_ptr<Job> job = parseJob(line);
+			if (job->command == "shutdown") {
+				{
+					std::lock_guard<std::mutex> guard(svc.lock);
+					svc.stopping = true;
+				}
+				svc.wake.notify_all();
+				/* Wakes up accept in main */
+				shutdown(svc.listenFd, SHUT_RDWR);
+				sendAll(fd, "ok shutting down\n");
+				closeClient(svc, id, fd);
+				return;
+			}
+
+			std::future<std::string> reply = job->reply.get_future();
+			{
+				std::lock_guard<std::mutex> guard(svc.lock);
+				if (svc.stopping) {
+					sendAll(fd, "error shutting down\n");
+					break;
+				}
+				job->seq = svc.nextSeq++;
+				svc.queue.push(job);
+			}
+			svc.wake.notify_one();
+			if (!sendAll(fd, reply.get() + "\n"))
+				break;
+		}
+	}
+	closeClient(svc, id, fd);
+}
+
+int main(int argc, char** argv)
+{
+	Service svc;
+	std::string socketPath;
+	int threads = 0;
+
+	for (int i = 1; i < argc; i++) {
+		std::string a = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (a == "--verbose")
+			svc.verbose = true;
+		else if (a == "--socket" && hasValue)
+			socketPath = argv[++i];
+		else if (a == "--threads" && hasValue)
+			threads = atoi(argv[++i]);
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (socketPath.empty()) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof addr.sun_path) {
+		fprintf(stderr, "socket path too long\n");
+		return 1;
+	}
+	strcpy(addr.sun_path, socketPath.c_str());
+
+	signal(SIGPIPE, SIG_IGN);
+	svc.listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socketPath.c_str());
+	if (svc.listenFd < 0 || bind(svc.listenFd, (struct sockaddr*)&addr, sizeof addr) != 0 || listen(svc.listenFd, 16) != 0) {
+		fprintf(stderr, "could not listen on \"%s\": %s\n", socketPath.c_str(), strerror(errno));
+		return 1;
+	}
+
+	if (threads > 0)
+		setNumThreads(threads);
+	ThreadPool pool(threads);
+	svc.pool = &pool;
+	std::thread worker(workerMain, std::ref(svc));
+	std::map<uint64_t, std::thread> clients;
+	uint64_t nextClient = 0;
+	fprintf(stderr, "listening on %s\n", socketPath.c_str());
+
+	for (;;) {
+		int fd = accept(svc.listenFd, nullptr, nullptr);
+		if (fd < 0) {
+			std::lock_guard<std::mutex> guard(svc.lock);
+			if (svc.stopping)
+				break;
+			continue;
+		}
+
+		/* Reap the clients that have gone */
+		std::vector<uint64_t> finished;
+		{
+			std::lock_guard<std::mutex> guard(svc.lock);
+			finished.swap(svc.finishedClients);
+			svc.clientFds[nextClient] = fd;
+		}
+		for (uint64_t id : finished) {
+			clients[id].join();
+			clients.erase(id);
+		}
+		clients[nextClient] = std::thread(clientMain, std::ref(svc), nextClient, fd);
+		nextClient++;
+	}
+
+	/* Queued jobs still run and are answered, then the clients still
+	 * connected are hung up on so they can be joined */
+	worker.join();
+	{
+		std::lock_guard<std::mutex> guard(svc.lock);
+		for (auto& it : svc.clientFds)
+			shutdown(it.second, SHUT_RDWR);
+	}
+	for (auto& it : clients)
+		it.second.join();
+	close(svc.listenFd);
+	unlink(socketPath.c_str());
+	return 0;
+}